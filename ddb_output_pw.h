@@ -0,0 +1,80 @@
+/*
+    PipeWire output plugin for DeaDBeeF Player
+    Copyright (C) 2020 Nicolai Syvertsen <saivert@saivert.com>
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/* Messages understood by the PipeWire output plugin ("pipewire").
+ *
+ * Queries are sent straight to the plugin, never through sendmessage:
+ *
+ *   DB_plugin_t *pw = deadbeef->plug_get_for_id("pipewire");
+ *   ddb_pw_latency_t lat = { ._size = sizeof(lat) };
+ *   if (pw && pw->message(DDB_PW_MSG_GET_LATENCY, (uintptr_t)&lat, 0, 0) == 0) ...
+ *
+ * Notifications are broadcast with deadbeef->sendmessage and reach every
+ * plugin's message handler.
+ */
+
+#ifndef DDB_OUTPUT_PW_H
+#define DDB_OUTPUT_PW_H
+
+#include <stdint.h>
+
+// Far away from DeaDBeeF's own event ids
+#define DDB_PW_MSG_BASE 0x50570000
+
+// ctx points to a ddb_pw_latency_t with _size set, returns 0 when filled in
+#define DDB_PW_MSG_GET_LATENCY (DDB_PW_MSG_BASE + 1)
+
+/* ctx points to a ddb_pw_meter_t with _size set, returns 0 when filled in.
+ * The meter only runs while someone asks for it, so the first call after a
+ * quiet spell starts it and comes back with frames == 0. */
+#define DDB_PW_MSG_GET_METER (DDB_PW_MSG_BASE + 2)
+
+// Writes the binary trace recorded so far to pipewire.tracefile, returns 0 when tracing is on
+#define DDB_PW_MSG_TRACE_FLUSH (DDB_PW_MSG_BASE + 3)
+
+// Broadcast when the smoothed latency moved, p1 is the new total in microseconds
+#define DDB_PW_EV_LATENCY_CHANGED (DDB_PW_MSG_BASE + 0x100)
+
+/* Time from a sample leaving streamer_read until it is heard. All values
+ * are in nanoseconds; total is smoothed, the parts are the latest sample. */
+typedef struct {
+    uint32_t _size;
+    int64_t total;
+    int64_t graph;
+    int64_t stream;
+    int64_t ring;
+    // CLOCK_MONOTONIC time of the quantum the parts were taken from
+    int64_t updated;
+} ddb_pw_latency_t;
+
+#define DDB_PW_METER_CHANNELS 64
+
+/* Levels of what was last handed to PipeWire, after any conversion, over a
+ * window of about 50 ms. Linear, 1.0 is full scale. */
+typedef struct {
+    uint32_t _size;
+    uint32_t channels;
+    // Frames the window covered, 0 until the first window after the meter started
+    uint32_t frames;
+    // CLOCK_MONOTONIC time the window closed
+    int64_t updated;
+    float peak[DDB_PW_METER_CHANNELS];
+    float rms[DDB_PW_METER_CHANNELS];
+} ddb_pw_meter_t;
+
+#endif
@@ -0,0 +1,475 @@
+/*
+    PipeWire output plugin for DeaDBeeF Player
+    Copyright (C) 2020 Nicolai Syvertsen <saivert@saivert.com>
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/* Benchmark for the RT output path, runs without DeaDBeeF or a sound server.
+ *
+ * pw.c is compiled into this program against a stub DB_functions_t: the
+ * streamer hands out a synthetic tone, titleformatting and metadata lookups
+ * return fixed strings, and the mutexes are plain recursive pthread mutexes.
+ * The stream is never connected. process_main dequeues the buffers this
+ * program owns and queues them back to it, notify_loop signals the event of
+ * a loop that is never started.
+ *
+ * For every sample format, channel count and output conversion the plugin
+ * supports it times fill_buffer (ring read with conversion or deinterleave),
+ * meter_update and whole on_process callbacks with and without the meter,
+ * and prints ns per callback, cycles per frame and latency percentiles.
+ * The loop side gets the format pod with its channel map and the media
+ * properties.
+ *
+ *   ddbpw-bench [quantum frames] [callbacks per case]
+ */
+
+#define pw_stream_dequeue_buffer bench_dequeue_buffer
+#define pw_stream_queue_buffer bench_queue_buffer
+#define pw_stream_get_time_n bench_get_time_n
+#include "pw.c"
+
+#include <pthread.h>
+#include <stdarg.h>
+
+#define BENCH_RATE 48000
+#define BENCH_MAX_CHANNELS 8
+#define BENCH_DEFAULT_QUANTUM 1024
+#define BENCH_DEFAULT_CALLBACKS 10000
+#define BENCH_WARMUP 200
+#define BENCH_LOOP_ITERATIONS 2000
+
+static int bench_conf_convert;
+static DB_playItem_t bench_track;
+static uint32_t bench_phase;
+
+static struct pw_buffer bench_pwbuf;
+static struct spa_buffer bench_buf;
+static struct spa_data bench_datas[BENCH_MAX_CHANNELS];
+static struct spa_chunk bench_chunks[BENCH_MAX_CHANNELS];
+static int bench_dequeued;
+
+static uint64_t *bench_ns;
+static uint64_t *bench_cycles;
+
+// The stream side of process_main, one buffer that is either ours or the plugin's
+struct pw_buffer *bench_dequeue_buffer(struct pw_stream *stream) {
+    if (bench_dequeued) {
+        return NULL;
+    }
+    bench_dequeued = 1;
+    return &bench_pwbuf;
+}
+
+int bench_queue_buffer(struct pw_stream *stream, struct pw_buffer *b) {
+    bench_dequeued = 0;
+    return 0;
+}
+
+// A graph one quantum deep, enough for latency_update to do its arithmetic
+int bench_get_time_n(struct pw_stream *stream, struct pw_time *time, size_t size) {
+    memset(time, 0, size);
+    time->now = get_monotonic_ns();
+    time->rate.num = 1;
+    time->rate.denom = BENCH_RATE;
+    time->delay = __atomic_load_n(&_buffersize, __ATOMIC_RELAXED);
+    return 0;
+}
+
+static uintptr_t bench_mutex_create(void) {
+    pthread_mutex_t *m = malloc(sizeof(pthread_mutex_t));
+    pthread_mutexattr_t attr;
+
+    // DeaDBeeF's mutexes are recursive, the plugin relies on it
+    pthread_mutexattr_init(&attr);
+    pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE);
+    pthread_mutex_init(m, &attr);
+    pthread_mutexattr_destroy(&attr);
+    return (uintptr_t)m;
+}
+
+static void bench_mutex_free(uintptr_t mtx) {
+    if (mtx) {
+        pthread_mutex_destroy((pthread_mutex_t *)mtx);
+        free((void *)mtx);
+    }
+}
+
+static int bench_mutex_lock(uintptr_t mtx) {
+    return pthread_mutex_lock((pthread_mutex_t *)mtx);
+}
+
+static int bench_mutex_unlock(uintptr_t mtx) {
+    return pthread_mutex_unlock((pthread_mutex_t *)mtx);
+}
+
+static int bench_conf_get_int(const char *key, int def) {
+    if (!strcmp(key, CONFSTR_DDBPW_CONVERT)) {
+        return bench_conf_convert;
+    }
+    return def;
+}
+
+static void bench_conf_get_str(const char *key, const char *def, char *buffer, int buffer_size) {
+    snprintf(buffer, buffer_size, "%s", def);
+}
+
+static void bench_log_detailed(DB_plugin_t *p, uint32_t layers, const char *fmt, ...) {
+    va_list ap;
+
+    // Errors only, the info lines would drown the table
+    if (layers != DDB_LOG_LAYER_DEFAULT) {
+        return;
+    }
+    va_start(ap, fmt);
+    vfprintf(stderr, fmt, ap);
+    va_end(ap);
+}
+
+static int bench_streamer_ok_to_read(int len) {
+    return 1;
+}
+
+// A triangle at a few hundred Hz in whatever format plugin.fmt says, no denormals and no NaNs
+static int bench_streamer_read(char *bytes, int size) {
+    int bytes_per_sample = plugin.fmt.bps / 8;
+    int n = size / bytes_per_sample;
+
+    for (int i = 0; i < n; i++) {
+        uint32_t t = bench_phase++ / plugin.fmt.channels % 256;
+        float v = (t < 128 ? (float)t : 256.0f - t) / 128.0f - 0.5f;
+        uint8_t *s = (uint8_t *)bytes + i * bytes_per_sample;
+
+        if (plugin.fmt.is_float) {
+            memcpy(s, &v, sizeof(float));
+        } else if (bytes_per_sample == 2) {
+            int16_t x = v * 32767;
+            memcpy(s, &x, 2);
+        } else {
+            int32_t x = v * 2147483647.0f;
+            memcpy(s, (uint8_t *)&x + 4 - bytes_per_sample, bytes_per_sample);
+        }
+    }
+    return n * bytes_per_sample;
+}
+
+static DB_playItem_t *bench_streamer_get_playing_track_safe(void) {
+    return &bench_track;
+}
+
+static void bench_pl_lock(void) {
+}
+
+static void bench_pl_unlock(void) {
+}
+
+static const char *bench_pl_find_meta(DB_playItem_t *it, const char *key) {
+    if (!strcmp(key, "artist")) {
+        return "Benchmark Artist";
+    }
+    if (!strcmp(key, "title")) {
+        return "Benchmark Title";
+    }
+    return NULL;
+}
+
+static void bench_pl_item_unref(DB_playItem_t *it) {
+}
+
+static char *bench_tf_compile(const char *script) {
+    return strdup(script);
+}
+
+static void bench_tf_free(char *code) {
+    free(code);
+}
+
+static int bench_tf_eval(ddb_tf_context_t *ctx, const char *code, char *out, int outlen) {
+    return snprintf(out, outlen, "%s - %s", bench_pl_find_meta(ctx->it, "artist"), bench_pl_find_meta(ctx->it, "title"));
+}
+
+static float bench_volume_get_amp(void) {
+    return 1.0f;
+}
+
+static int bench_sendmessage(uint32_t id, uintptr_t ctx, uint32_t p1, uint32_t p2) {
+    return 0;
+}
+
+static DB_functions_t bench_api = {
+    .vmajor = DB_API_VERSION_MAJOR,
+    .vminor = DB_API_VERSION_MINOR,
+    .mutex_create = bench_mutex_create,
+    .mutex_free = bench_mutex_free,
+    .mutex_lock = bench_mutex_lock,
+    .mutex_unlock = bench_mutex_unlock,
+    .conf_get_int = bench_conf_get_int,
+    .conf_get_str = bench_conf_get_str,
+    .log_detailed = bench_log_detailed,
+    .streamer_ok_to_read = bench_streamer_ok_to_read,
+    .streamer_read = bench_streamer_read,
+    .streamer_get_playing_track_safe = bench_streamer_get_playing_track_safe,
+    .pl_lock = bench_pl_lock,
+    .pl_unlock = bench_pl_unlock,
+    .pl_find_meta = bench_pl_find_meta,
+    .pl_item_unref = bench_pl_item_unref,
+    .tf_compile = bench_tf_compile,
+    .tf_free = bench_tf_free,
+    .tf_eval = bench_tf_eval,
+    .volume_get_amp = bench_volume_get_amp,
+    .sendmessage = bench_sendmessage,
+};
+
+static void on_bench_notify(void *userdata, uint64_t count) {
+}
+
+static const char *convert_name(int convert) {
+    switch (convert) {
+    case DDBPW_CONVERT_F32:
+        return "f32";
+    case DDBPW_CONVERT_S24_32:
+        return "s24_32";
+    case DDBPW_CONVERT_F32P:
+        return "f32p";
+    default:
+        return "off";
+    }
+}
+
+static int compare_u64(const void *a, const void *b) {
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+    return x < y ? -1 : x > y;
+}
+
+static void report(const char *fmtname, int channels, int convert, const char *stage, int n, uint32_t frames) {
+    uint64_t sum_ns = 0, sum_cycles = 0;
+
+    for (int i = 0; i < n; i++) {
+        sum_ns += bench_ns[i];
+        sum_cycles += bench_cycles[i];
+    }
+    qsort(bench_ns, n, sizeof(uint64_t), compare_u64);
+    printf("%-4s %3d  %-6s  %-14s %8.0f %9.2f %8" PRIu64 " %8" PRIu64 " %8" PRIu64 " %8" PRIu64 "\n",
+        fmtname, channels, convert_name(convert), stage,
+        (double)sum_ns / n, (double)sum_cycles / n / frames,
+        bench_ns[n / 2], bench_ns[(int)(n * 0.99)], bench_ns[(int)(n * 0.999)], bench_ns[n - 1]);
+}
+
+// What the feeder does between two callbacks, kept out of the timings
+static void bench_feed(uint32_t frames) {
+    uint32_t len = frames * _stride;
+
+    while (sem_trywait(&data.feeder_sem) == 0) {
+    }
+    deadbeef->mutex_lock(mutex);
+    while (len) {
+        uint32_t n = SPA_MIN(len, sizeof(data.feeder_chunk));
+        n -= n % _stride;
+        n = deadbeef->streamer_read(data.feeder_chunk, n);
+        feeder_write(data.feeder_chunk, n, data.seek_gen);
+        len -= n;
+    }
+    deadbeef->mutex_unlock(mutex);
+}
+
+// Points the plugin at one format the way ddbpw_set_spec would, minus the stream
+static int bench_setup(int bps, int is_float, int channels, int convert, uint32_t quantum) {
+    uint8_t pod[1024];
+
+    bench_conf_convert = convert;
+    memset(&plugin.fmt, 0, sizeof(plugin.fmt));
+    plugin.fmt.bps = bps;
+    plugin.fmt.is_float = is_float;
+    plugin.fmt.channels = channels;
+    plugin.fmt.samplerate = BENCH_RATE;
+    plugin.fmt.channelmask = (1u << channels) - 1;
+
+    // Combinations the plugin turns into something else, f32 to s24_32 for one
+    if (setup_convert() != convert || !makeformat(&plugin.fmt, convert, pod, sizeof(pod))) {
+        return -1;
+    }
+    __atomic_store_n(&_buffersize, quantum, __ATOMIC_RELAXED);
+
+    data.ring.readindex = data.ring.writeindex = 0;
+    memset(&data.stats, 0, sizeof(data.stats));
+    data.out_latency_reported = 0;
+    data.meter_running = 0;
+
+    bench_buf.n_datas = _planar ? channels : 1;
+    for (uint32_t i = 0; i < bench_buf.n_datas; i++) {
+        bench_datas[i].maxsize = quantum * (_planar ? sizeof(float) : (uint32_t)_out_stride);
+    }
+    bench_pwbuf.requested = quantum;
+    bench_dequeued = 0;
+    return 0;
+}
+
+static void bench_case(const char *fmtname, int channels, int convert, uint32_t quantum, int n) {
+    // fill_buffer alone, the ring read with conversion or deinterleave
+    for (int i = -BENCH_WARMUP; i < n; i++) {
+        bench_feed(quantum);
+        int64_t start = get_monotonic_ns();
+        uint64_t start_cycles = read_cycles();
+        fill_buffer(&data.ring, &data.ring.readindex, &bench_buf, quantum, 0);
+        if (i >= 0) {
+            bench_cycles[i] = read_cycles() - start_cycles;
+            bench_ns[i] = get_monotonic_ns() - start;
+        }
+    }
+    report(fmtname, channels, convert, "fill", n, quantum);
+
+    // The meter over what fill_buffer left in the buffer
+    for (int i = -BENCH_WARMUP; i < n; i++) {
+        int64_t start = get_monotonic_ns();
+        uint64_t start_cycles = read_cycles();
+        meter_update(&data, &bench_buf, quantum, start);
+        if (i >= 0) {
+            bench_cycles[i] = read_cycles() - start_cycles;
+            bench_ns[i] = get_monotonic_ns() - start;
+        }
+    }
+    report(fmtname, channels, convert, "meter", n, quantum);
+
+    // Whole callbacks, first with nobody looking at the levels, then with the meter on
+    for (int meter = 0; meter < 2; meter++) {
+        for (int i = -BENCH_WARMUP; i < n; i++) {
+            bench_feed(quantum);
+            __atomic_store_n(&data.meter_wanted, meter ? get_monotonic_ns() : 0, __ATOMIC_RELAXED);
+            int64_t start = get_monotonic_ns();
+            uint64_t start_cycles = read_cycles();
+            on_process(&data);
+            if (i >= 0) {
+                bench_cycles[i] = read_cycles() - start_cycles;
+                bench_ns[i] = get_monotonic_ns() - start;
+            }
+        }
+        report(fmtname, channels, convert, meter ? "on_process+mtr" : "on_process", n, quantum);
+    }
+    if (STAT_GET(data.stats.underruns)) {
+        fprintf(stderr, "%s %dch %s: %" PRIu64 " underruns, the feed did not keep up\n",
+            fmtname, channels, convert_name(convert), STAT_GET(data.stats.underruns));
+    }
+}
+
+// Loop side, once per format change and once per track
+static void bench_loop_side(void) {
+    static const int channel_counts[] = { 1, 2, 6, 8 };
+    uint8_t pod[1024];
+
+    printf("\nloop side, average of %d\n", BENCH_LOOP_ITERATIONS);
+    plugin.fmt.bps = 16;
+    plugin.fmt.is_float = 0;
+    plugin.fmt.samplerate = BENCH_RATE;
+    for (size_t c = 0; c < SPA_N_ELEMENTS(channel_counts); c++) {
+        plugin.fmt.channels = channel_counts[c];
+        plugin.fmt.channelmask = (1u << channel_counts[c]) - 1;
+        int64_t start = get_monotonic_ns();
+        for (int i = 0; i < BENCH_LOOP_ITERATIONS; i++) {
+            makeformat(&plugin.fmt, DDBPW_CONVERT_OFF, pod, sizeof(pod));
+        }
+        printf("format pod with channel map, %dch   %8.0f ns\n", channel_counts[c],
+            (double)(get_monotonic_ns() - start) / BENCH_LOOP_ITERATIONS);
+    }
+
+    int64_t start = get_monotonic_ns();
+    for (int i = 0; i < BENCH_LOOP_ITERATIONS; i++) {
+        pw_properties_free(media_props_build(&bench_track));
+    }
+    printf("media properties                     %8.0f ns\n", (double)(get_monotonic_ns() - start) / BENCH_LOOP_ITERATIONS);
+}
+
+int main(int argc, char **argv) {
+    static const struct {
+        const char *name;
+        int bps;
+        int is_float;
+    } formats[] = {
+        { "s16", 16, 0 },
+        { "s24", 24, 0 },
+        { "s32", 32, 0 },
+        { "f32", 32, 1 },
+    };
+    static const int channel_counts[] = { 1, 2, 6, 8 };
+    static const int converts[] = { DDBPW_CONVERT_OFF, DDBPW_CONVERT_F32, DDBPW_CONVERT_S24_32, DDBPW_CONVERT_F32P };
+    uint32_t quantum = argc > 1 ? (uint32_t)atoi(argv[1]) : BENCH_DEFAULT_QUANTUM;
+    int n = argc > 2 ? atoi(argv[2]) : BENCH_DEFAULT_CALLBACKS;
+
+    if (quantum == 0 || quantum > 16384 || n <= 0) {
+        fprintf(stderr, "usage: %s [quantum frames, up to 16384] [callbacks per case]\n", argv[0]);
+        return 1;
+    }
+
+    pw_init(&argc, &argv);
+    DB_plugin_t *p = ddb_out_pw_load(&bench_api);
+    p->start();
+
+    data.loop = pw_thread_loop_new("ddbpw-bench", NULL);
+    data.notify_event = pw_loop_add_event(pw_thread_loop_get_loop(data.loop), on_bench_notify, &data);
+    // Only handed to the bench_* stream functions, never dereferenced
+    data.stream = (struct pw_stream *)&bench_pwbuf;
+    sem_init(&data.feeder_sem, 0, 0);
+    if (ring_alloc(&data.ring, quantum * BENCH_MAX_CHANNELS * 4 * 4) < 0) {
+        fprintf(stderr, "could not allocate the ring\n");
+        return 1;
+    }
+
+    bench_buf.datas = bench_datas;
+    bench_pwbuf.buffer = &bench_buf;
+    for (int i = 0; i < BENCH_MAX_CHANNELS; i++) {
+        void *mem = NULL;
+        if (posix_memalign(&mem, DDBPW_CACHELINE, quantum * BENCH_MAX_CHANNELS * 4) != 0) {
+            fprintf(stderr, "could not allocate buffers\n");
+            return 1;
+        }
+        memset(mem, 0, quantum * BENCH_MAX_CHANNELS * 4);
+        bench_datas[i].data = mem;
+        bench_datas[i].chunk = &bench_chunks[i];
+    }
+    bench_ns = calloc(n, sizeof(uint64_t));
+    bench_cycles = calloc(n, sizeof(uint64_t));
+    if (!bench_ns || !bench_cycles) {
+        fprintf(stderr, "could not allocate %d samples\n", n);
+        return 1;
+    }
+
+    printf("quantum %u frames at %d Hz, %d callbacks per case, times in ns\n\n", quantum, BENCH_RATE, n);
+    printf("fmt   ch  output  stage             ns/cb cyc/frame      p50      p99    p99.9      max\n");
+    for (size_t f = 0; f < SPA_N_ELEMENTS(formats); f++) {
+        for (size_t c = 0; c < SPA_N_ELEMENTS(channel_counts); c++) {
+            for (size_t v = 0; v < SPA_N_ELEMENTS(converts); v++) {
+                if (bench_setup(formats[f].bps, formats[f].is_float, channel_counts[c], converts[v], quantum) < 0) {
+                    continue;
+                }
+                bench_case(formats[f].name, channel_counts[c], converts[v], quantum, n);
+            }
+        }
+    }
+    bench_loop_side();
+
+    data.stream = NULL;
+    pw_loop_destroy_source(pw_thread_loop_get_loop(data.loop), data.notify_event);
+    data.notify_event = NULL;
+    pw_thread_loop_destroy(data.loop);
+    data.loop = NULL;
+    sem_destroy(&data.feeder_sem);
+    ring_free(&data.ring);
+    for (int i = 0; i < BENCH_MAX_CHANNELS; i++) {
+        free(bench_datas[i].data);
+    }
+    free(bench_ns);
+    free(bench_cycles);
+    p->stop();
+    pw_deinit();
+    return 0;
+}
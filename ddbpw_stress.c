@@ -0,0 +1,719 @@
+/*
+    PipeWire output plugin for DeaDBeeF Player
+    Copyright (C) 2020 Nicolai Syvertsen <saivert@saivert.com>
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/* Stress harness for playback transitions, runs against a local PipeWire
+ * daemon without DeaDBeeF.
+ *
+ * pw.c is compiled into this program against a stub DB_functions_t whose
+ * streamer hands out a tone in whatever format the last track change asked
+ * for. The harness creates a null sink on the daemon and points the plugin
+ * at it, so nothing is heard and no hardware clock is needed.
+ *
+ * One thread per operation hammers play, stop, pause, unpause, setformat,
+ * seek (DB_EV_SEEK then DB_EV_SEEKED) and the latency, meter and volume
+ * messages at random intervals. Track changes also arrive the way DeaDBeeF
+ * sends them, with setformat called from inside streamer_read on the
+ * feeder thread. A watchdog reports any call that does not return within
+ * the deadlock timeout, with what every other thread is doing at the time,
+ * and aborts so a debugger or the sanitizer gets the stacks. It also
+ * counts streams that stop consuming while they should be playing.
+ *
+ * At the end it prints a log2 histogram of how long each call took for
+ * the caller, and the plugin's own histogram of how long each transition
+ * took until it was heard. Build it with -fsanitize=thread (make stress)
+ * or -fsanitize=address (make stress-asan) to get the races reported.
+ *
+ *   ddbpw-stress [-v] [seconds] [key=value ...]
+ *
+ * key=value pairs override plugin settings, pipewire.keepconnected=1 or
+ * pipewire.warmpause=1 for instance. -v passes the plugin's info log through.
+ */
+
+#include "pw.c"
+
+#include <stdarg.h>
+
+#define STRESS_DEFAULT_SECONDS 60
+#define STRESS_SINK_NAME "ddbpw-stress-sink"
+// A call that takes this long is taken for a deadlock
+#define STRESS_DEADLOCK_MS 5000
+// A stream that should be playing and read nothing for this long counts as stuck
+#define STRESS_STALL_MS 3000
+#define STRESS_WATCHDOG_MS 100
+#define STRESS_MAX_CONF 32
+// Bucket i counts calls under 1 << i us
+#define STRESS_BUCKETS 24
+
+enum {
+    STRESS_PLAY,
+    STRESS_STOP,
+    STRESS_PAUSE,
+    STRESS_UNPAUSE,
+    STRESS_SETFORMAT,
+    STRESS_TRACK,
+    STRESS_SEEK,
+    STRESS_QUERY,
+    STRESS_OPS
+};
+
+static const struct {
+    const char *name;
+    // Random pause between two calls, in ms
+    int min_gap;
+    int max_gap;
+} stress_ops[STRESS_OPS] = {
+    [STRESS_PLAY] = { "play", 0, 300 },
+    [STRESS_STOP] = { "stop", 50, 700 },
+    [STRESS_PAUSE] = { "pause", 20, 400 },
+    [STRESS_UNPAUSE] = { "unpause", 20, 400 },
+    [STRESS_SETFORMAT] = { "setformat", 10, 300 },
+    [STRESS_TRACK] = { "track", 50, 500 },
+    [STRESS_SEEK] = { "seek", 10, 250 },
+    [STRESS_QUERY] = { "query", 0, 20 },
+};
+
+struct stress_hist {
+    uint64_t n;
+    uint64_t sum_ns;
+    uint64_t max_ns;
+    uint64_t hist[STRESS_BUCKETS];
+};
+
+// What each thread is doing, read by the watchdog
+struct stress_slot {
+    int op;
+    int64_t started;
+};
+
+static struct stress_hist stress_hists[STRESS_OPS];
+static struct stress_slot stress_slots[STRESS_OPS + 1];
+static int stress_quit;
+static int stress_watchdog_quit;
+static uint64_t stress_stalls;
+static uint64_t stress_stop_events;
+static int stress_stop_pending;
+// Bytes the feeder took from the streamer, they only keep coming while the stream plays
+static uint64_t stress_bytes_read;
+
+static struct {
+    char key[64];
+    char value[256];
+} stress_conf[STRESS_MAX_CONF];
+static int n_stress_conf;
+static int stress_verbose;
+
+// The streamer's side of the format, which the plugin may not have switched to yet
+static pthread_mutex_t stress_fmt_mutex = PTHREAD_MUTEX_INITIALIZER;
+static ddb_waveformat_t stress_fmt;
+static ddb_waveformat_t stress_next_fmt;
+static int stress_track_pending;
+static uint32_t stress_phase;
+static DB_playItem_t stress_track;
+
+static const ddb_waveformat_t stress_formats[] = {
+    { .bps = 16, .channels = 2, .samplerate = 44100, .channelmask = 3 },
+    { .bps = 16, .channels = 2, .samplerate = 48000, .channelmask = 3 },
+    { .bps = 24, .channels = 2, .samplerate = 96000, .channelmask = 3 },
+    { .bps = 32, .channels = 2, .samplerate = 88200, .channelmask = 3, .is_float = 1 },
+    { .bps = 16, .channels = 1, .samplerate = 22050, .channelmask = 1 },
+    { .bps = 32, .channels = 6, .samplerate = 48000, .channelmask = 0x3f },
+};
+
+static uint32_t stress_rand(uint32_t *seed) {
+    *seed = *seed * 1103515245 + 12345;
+    return *seed >> 8;
+}
+
+static void stress_sleep_ms(int ms) {
+    struct timespec ts = { ms / 1000, ms % 1000 * SPA_NSEC_PER_MSEC };
+    while (nanosleep(&ts, &ts) == -1 && errno == EINTR);
+}
+
+static void stress_begin(int slot, int op) {
+    __atomic_store_n(&stress_slots[slot].op, op, __ATOMIC_RELAXED);
+    __atomic_store_n(&stress_slots[slot].started, get_monotonic_ns(), __ATOMIC_RELEASE);
+}
+
+// Only the thread that owns the op writes its histogram
+static void stress_end(int slot, int op) {
+    struct stress_hist *h = &stress_hists[op];
+    int64_t ns = get_monotonic_ns() - __atomic_load_n(&stress_slots[slot].started, __ATOMIC_RELAXED);
+    uint64_t us = ns / SPA_NSEC_PER_USEC;
+
+    __atomic_store_n(&stress_slots[slot].started, 0, __ATOMIC_RELEASE);
+    __atomic_fetch_add(&h->n, 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&h->sum_ns, ns, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&h->hist[us ? SPA_MIN(64 - __builtin_clzll(us), STRESS_BUCKETS - 1) : 0], 1, __ATOMIC_RELAXED);
+    if ((uint64_t)ns > __atomic_load_n(&h->max_ns, __ATOMIC_RELAXED)) {
+        __atomic_store_n(&h->max_ns, ns, __ATOMIC_RELAXED);
+    }
+}
+
+static uintptr_t stress_mutex_create(void) {
+    pthread_mutex_t *m = malloc(sizeof(pthread_mutex_t));
+    pthread_mutexattr_t attr;
+
+    // DeaDBeeF's mutexes are recursive, the plugin relies on it
+    pthread_mutexattr_init(&attr);
+    pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE);
+    pthread_mutex_init(m, &attr);
+    pthread_mutexattr_destroy(&attr);
+    return (uintptr_t)m;
+}
+
+static void stress_mutex_free(uintptr_t mtx) {
+    if (mtx) {
+        pthread_mutex_destroy((pthread_mutex_t *)mtx);
+        free((void *)mtx);
+    }
+}
+
+static int stress_mutex_lock(uintptr_t mtx) {
+    return pthread_mutex_lock((pthread_mutex_t *)mtx);
+}
+
+static int stress_mutex_unlock(uintptr_t mtx) {
+    return pthread_mutex_unlock((pthread_mutex_t *)mtx);
+}
+
+struct stress_thread_start {
+    void (*fn)(void *ctx);
+    void *ctx;
+};
+
+static void *stress_thread_main(void *arg) {
+    struct stress_thread_start start = *(struct stress_thread_start *)arg;
+
+    free(arg);
+    start.fn(start.ctx);
+    return NULL;
+}
+
+static intptr_t stress_thread_start(void (*fn)(void *ctx), void *ctx) {
+    struct stress_thread_start *start = malloc(sizeof(*start));
+    pthread_t tid;
+
+    start->fn = fn;
+    start->ctx = ctx;
+    if (pthread_create(&tid, NULL, stress_thread_main, start) != 0) {
+        free(start);
+        return 0;
+    }
+    return (intptr_t)tid;
+}
+
+static int stress_thread_join(intptr_t tid) {
+    return pthread_join((pthread_t)tid, NULL);
+}
+
+static const char *stress_conf_find(const char *key) {
+    for (int i = 0; i < n_stress_conf; i++) {
+        if (!strcmp(stress_conf[i].key, key)) {
+            return stress_conf[i].value;
+        }
+    }
+    return NULL;
+}
+
+static int stress_conf_get_int(const char *key, int def) {
+    const char *value = stress_conf_find(key);
+    return value ? atoi(value) : def;
+}
+
+static void stress_conf_get_str(const char *key, const char *def, char *buffer, int buffer_size) {
+    const char *value = stress_conf_find(key);
+    snprintf(buffer, buffer_size, "%s", value ? value : def);
+}
+
+static void stress_conf_set(const char *key, const char *value) {
+    for (int i = 0; i < n_stress_conf; i++) {
+        if (!strcmp(stress_conf[i].key, key)) {
+            snprintf(stress_conf[i].value, sizeof(stress_conf[i].value), "%s", value);
+            return;
+        }
+    }
+    if (n_stress_conf < STRESS_MAX_CONF) {
+        snprintf(stress_conf[n_stress_conf].key, sizeof(stress_conf[n_stress_conf].key), "%s", key);
+        snprintf(stress_conf[n_stress_conf].value, sizeof(stress_conf[n_stress_conf].value), "%s", value);
+        n_stress_conf++;
+    }
+}
+
+static void stress_log_detailed(DB_plugin_t *p, uint32_t layers, const char *fmt, ...) {
+    va_list ap;
+
+    // The info lines of a few thousand transitions would drown the report
+    if (layers != DDB_LOG_LAYER_DEFAULT && !__atomic_load_n(&stress_verbose, __ATOMIC_RELAXED)) {
+        return;
+    }
+    va_start(ap, fmt);
+    vfprintf(stderr, fmt, ap);
+    va_end(ap);
+}
+
+static int stress_streamer_ok_to_read(int len) {
+    return 1;
+}
+
+/* Feeder thread. A track change hands the plugin the new format from in
+ * here, ahead of the first bytes in it, as DeaDBeeF's streamer does. */
+static int stress_streamer_read(char *bytes, int size) {
+    ddb_waveformat_t fmt;
+
+    pthread_mutex_lock(&stress_fmt_mutex);
+    int track = stress_track_pending;
+    if (track) {
+        stress_fmt = stress_next_fmt;
+        stress_track_pending = 0;
+    }
+    fmt = stress_fmt;
+    pthread_mutex_unlock(&stress_fmt_mutex);
+
+    if (track) {
+        stress_begin(STRESS_OPS, STRESS_TRACK);
+        plugin.setformat(&fmt);
+        stress_end(STRESS_OPS, STRESS_TRACK);
+    }
+
+    int bytes_per_sample = fmt.bps / 8;
+    int stride = bytes_per_sample * fmt.channels;
+    int n = size / stride * fmt.channels;
+
+    for (int i = 0; i < n; i++) {
+        uint32_t t = stress_phase++ / fmt.channels % 256;
+        float v = ((t < 128 ? (float)t : 256.0f - t) / 128.0f - 0.5f) * 0.1f;
+        uint8_t *s = (uint8_t *)bytes + i * bytes_per_sample;
+
+        if (fmt.is_float) {
+            memcpy(s, &v, sizeof(float));
+        } else if (bytes_per_sample == 2) {
+            int16_t x = v * 32767;
+            memcpy(s, &x, 2);
+        } else {
+            int32_t x = v * 2147483647.0f;
+            memcpy(s, (uint8_t *)&x + 4 - bytes_per_sample, bytes_per_sample);
+        }
+    }
+    __atomic_fetch_add(&stress_bytes_read, n * bytes_per_sample, __ATOMIC_RELAXED);
+    return n * bytes_per_sample;
+}
+
+static DB_playItem_t *stress_streamer_get_playing_track_safe(void) {
+    return &stress_track;
+}
+
+static void stress_pl_lock(void) {
+}
+
+static void stress_pl_unlock(void) {
+}
+
+static const char *stress_pl_find_meta(DB_playItem_t *it, const char *key) {
+    if (!strcmp(key, "artist")) {
+        return "Stress Artist";
+    }
+    if (!strcmp(key, "title")) {
+        return "Stress Title";
+    }
+    return NULL;
+}
+
+static void stress_pl_item_unref(DB_playItem_t *it) {
+}
+
+static char *stress_tf_compile(const char *script) {
+    return strdup(script);
+}
+
+static void stress_tf_free(char *code) {
+    free(code);
+}
+
+static int stress_tf_eval(ddb_tf_context_t *ctx, const char *code, char *out, int outlen) {
+    return snprintf(out, outlen, "%s - %s", stress_pl_find_meta(ctx->it, "artist"), stress_pl_find_meta(ctx->it, "title"));
+}
+
+static float stress_volume_get_amp(void) {
+    return 0.5f;
+}
+
+// The plugin asks for a stop when the stream fails, the stop thread delivers it later like DeaDBeeF would
+static int stress_sendmessage(uint32_t id, uintptr_t ctx, uint32_t p1, uint32_t p2) {
+    if (id == DB_EV_STOP) {
+        __atomic_fetch_add(&stress_stop_events, 1, __ATOMIC_RELAXED);
+        __atomic_store_n(&stress_stop_pending, 1, __ATOMIC_RELEASE);
+    }
+    return 0;
+}
+
+static DB_functions_t stress_api = {
+    .vmajor = DB_API_VERSION_MAJOR,
+    .vminor = DB_API_VERSION_MINOR,
+    .thread_start = stress_thread_start,
+    .thread_join = stress_thread_join,
+    .mutex_create = stress_mutex_create,
+    .mutex_free = stress_mutex_free,
+    .mutex_lock = stress_mutex_lock,
+    .mutex_unlock = stress_mutex_unlock,
+    .conf_get_int = stress_conf_get_int,
+    .conf_get_str = stress_conf_get_str,
+    .log_detailed = stress_log_detailed,
+    .streamer_ok_to_read = stress_streamer_ok_to_read,
+    .streamer_read = stress_streamer_read,
+    .streamer_get_playing_track_safe = stress_streamer_get_playing_track_safe,
+    .pl_lock = stress_pl_lock,
+    .pl_unlock = stress_pl_unlock,
+    .pl_find_meta = stress_pl_find_meta,
+    .pl_item_unref = stress_pl_item_unref,
+    .tf_compile = stress_tf_compile,
+    .tf_free = stress_tf_free,
+    .tf_eval = stress_tf_eval,
+    .volume_get_amp = stress_volume_get_amp,
+    .sendmessage = stress_sendmessage,
+};
+
+// The null sink lives on a connection of its own, the plugin's comes and goes
+struct stress_sink {
+    struct pw_thread_loop *loop;
+    struct pw_context *context;
+    struct pw_core *core;
+    struct spa_hook core_listener;
+    struct pw_proxy *proxy;
+    int seq;
+    int done;
+    int error;
+};
+
+static void on_sink_core_done(void *userdata, uint32_t id, int seq) {
+    struct stress_sink *s = userdata;
+
+    if (id == PW_ID_CORE && seq == s->seq) {
+        s->done = 1;
+        pw_thread_loop_signal(s->loop, false);
+    }
+}
+
+static void on_sink_core_error(void *userdata, uint32_t id, int seq, int res, const char *message) {
+    struct stress_sink *s = userdata;
+
+    fprintf(stderr, "null sink: error %d on object %u: %s\n", res, id, message);
+    s->error = res;
+    s->done = 1;
+    pw_thread_loop_signal(s->loop, false);
+}
+
+static const struct pw_core_events sink_core_events = {
+    PW_VERSION_CORE_EVENTS,
+    .done = on_sink_core_done,
+    .error = on_sink_core_error,
+};
+
+static int stress_sink_create(struct stress_sink *s) {
+    char remote[256];
+
+    memset(s, 0, sizeof(*s));
+    stress_conf_get_str(CONFSTR_DDBPW_REMOTENAME, DDBPW_DEFAULT_REMOTENAME, remote, sizeof(remote));
+    s->loop = pw_thread_loop_new("ddbpw-stress", NULL);
+    s->context = pw_context_new(pw_thread_loop_get_loop(s->loop), NULL, 0);
+    if (!s->context) {
+        return -1;
+    }
+    pw_thread_loop_start(s->loop);
+    pw_thread_loop_lock(s->loop);
+    s->core = pw_context_connect(s->context, pw_properties_new(PW_KEY_REMOTE_NAME, remote[0] ? remote : NULL, NULL), 0);
+    if (!s->core) {
+        pw_thread_loop_unlock(s->loop);
+        fprintf(stderr, "could not connect to the PipeWire daemon\n");
+        return -1;
+    }
+    pw_core_add_listener(s->core, &s->core_listener, &sink_core_events, s);
+
+    // What pw-cli create-node adapter does, gone with our connection
+    struct pw_properties *props = pw_properties_new(
+            "factory.name", "support.null-audio-sink",
+            PW_KEY_NODE_NAME, STRESS_SINK_NAME,
+            PW_KEY_NODE_DESCRIPTION, "ddbpw stress null sink",
+            PW_KEY_MEDIA_CLASS, "Audio/Sink",
+            "audio.position", "FL,FR",
+            "object.linger", "false",
+            NULL);
+    s->proxy = pw_core_create_object(s->core, "adapter", PW_TYPE_INTERFACE_Node, PW_VERSION_NODE, &props->dict, 0);
+    pw_properties_free(props);
+    if (!s->proxy) {
+        pw_thread_loop_unlock(s->loop);
+        fprintf(stderr, "could not create the null sink\n");
+        return -1;
+    }
+    s->seq = pw_core_sync(s->core, PW_ID_CORE, 0);
+    while (!s->done) {
+        if (pw_thread_loop_timed_wait(s->loop, STRESS_DEADLOCK_MS / 1000) != 0) {
+            break;
+        }
+    }
+    pw_thread_loop_unlock(s->loop);
+    if (!s->done || s->error) {
+        fprintf(stderr, "the daemon did not create the null sink\n");
+        return -1;
+    }
+    return 0;
+}
+
+static void stress_sink_destroy(struct stress_sink *s) {
+    if (s->loop) {
+        pw_thread_loop_stop(s->loop);
+    }
+    if (s->proxy) {
+        pw_proxy_destroy(s->proxy);
+    }
+    if (s->core) {
+        spa_hook_remove(&s->core_listener);
+        pw_core_disconnect(s->core);
+    }
+    if (s->context) {
+        pw_context_destroy(s->context);
+    }
+    if (s->loop) {
+        pw_thread_loop_destroy(s->loop);
+    }
+}
+
+static void stress_op(int op, uint32_t *seed) {
+    switch (op) {
+    case STRESS_PLAY:
+        plugin.play();
+        break;
+    case STRESS_STOP:
+        __atomic_store_n(&stress_stop_pending, 0, __ATOMIC_RELAXED);
+        plugin.stop();
+        break;
+    case STRESS_PAUSE:
+        plugin.pause();
+        break;
+    case STRESS_UNPAUSE:
+        plugin.unpause();
+        break;
+    case STRESS_SETFORMAT: {
+        ddb_waveformat_t fmt = stress_formats[stress_rand(seed) % SPA_N_ELEMENTS(stress_formats)];
+        pthread_mutex_lock(&stress_fmt_mutex);
+        stress_fmt = fmt;
+        pthread_mutex_unlock(&stress_fmt_mutex);
+        plugin.setformat(&fmt);
+        break;
+    }
+    case STRESS_TRACK: {
+        // The feeder picks it up on its next read and calls setformat from there
+        ddb_event_track_t ev = { .ev = { .event = DB_EV_SONGSTARTED, .size = sizeof(ev) }, .track = &stress_track };
+        pthread_mutex_lock(&stress_fmt_mutex);
+        stress_next_fmt = stress_formats[stress_rand(seed) % SPA_N_ELEMENTS(stress_formats)];
+        stress_track_pending = 1;
+        pthread_mutex_unlock(&stress_fmt_mutex);
+        plugin.plugin.message(DB_EV_SONGSTARTED, (uintptr_t)&ev, 0, 0);
+        break;
+    }
+    case STRESS_SEEK:
+        plugin.plugin.message(DB_EV_SEEKED, 0, 0, 0);
+        break;
+    case STRESS_QUERY: {
+        ddb_pw_latency_t latency = { ._size = sizeof(latency) };
+        ddb_pw_meter_t meter = { ._size = sizeof(meter) };
+        switch (stress_rand(seed) % 3) {
+        case 0:
+            plugin.plugin.message(DDB_PW_MSG_GET_LATENCY, (uintptr_t)&latency, 0, 0);
+            break;
+        case 1:
+            plugin.plugin.message(DDB_PW_MSG_GET_METER, (uintptr_t)&meter, 0, 0);
+            break;
+        default:
+            plugin.plugin.message(DB_EV_VOLUMECHANGED, 0, 0, 0);
+            break;
+        }
+        break;
+    }
+    }
+}
+
+static void stress_thread(void *ctx) {
+    int op = (int)(intptr_t)ctx;
+    uint32_t seed = 0x9e3779b9u * (op + 1);
+
+    while (!__atomic_load_n(&stress_quit, __ATOMIC_ACQUIRE)) {
+        int gap = stress_ops[op].min_gap;
+        if (stress_ops[op].max_gap > gap) {
+            gap += stress_rand(&seed) % (stress_ops[op].max_gap - gap);
+        }
+        stress_sleep_ms(gap);
+        // The feeder times its own calls, this only queues them
+        if (op == STRESS_TRACK) {
+            stress_op(op, &seed);
+            continue;
+        }
+        // The streamer announces the seek, moves, then says it is done. Only the last one is timed.
+        if (op == STRESS_SEEK) {
+            plugin.plugin.message(DB_EV_SEEK, 0, 0, 0);
+            stress_sleep_ms(stress_rand(&seed) % 5);
+        }
+        stress_begin(op, op);
+        stress_op(op, &seed);
+        stress_end(op, op);
+    }
+}
+
+static const char *stress_slot_name(int slot) {
+    return slot == STRESS_OPS ? "feeder" : stress_ops[slot].name;
+}
+
+static void stress_report_stuck(int stuck, int64_t now) {
+    fprintf(stderr, "\nDEADLOCK: %s thread stuck in %s for %.0f ms\n", stress_slot_name(stuck),
+        stress_ops[__atomic_load_n(&stress_slots[stuck].op, __ATOMIC_RELAXED)].name,
+        (now - __atomic_load_n(&stress_slots[stuck].started, __ATOMIC_ACQUIRE)) / 1e6);
+    for (int i = 0; i <= STRESS_OPS; i++) {
+        int64_t started = __atomic_load_n(&stress_slots[i].started, __ATOMIC_ACQUIRE);
+        if (i != stuck && started) {
+            fprintf(stderr, "  %s thread in %s for %.0f ms\n", stress_slot_name(i),
+                stress_ops[__atomic_load_n(&stress_slots[i].op, __ATOMIC_RELAXED)].name, (now - started) / 1e6);
+        }
+    }
+    fprintf(stderr, "  plugin state %d, format switch %s\n", __atomic_load_n(&state, __ATOMIC_ACQUIRE),
+        __atomic_load_n(&_setformat_requested, __ATOMIC_ACQUIRE) ? "pending" : "idle");
+    abort();
+}
+
+/* Calls that never return are deadlocks. A stream that is meant to be
+ * playing and stops reading the ring is the stuck stream users see. */
+static void stress_watchdog(void *ctx) {
+    uint64_t last_read = 0;
+    int64_t last_progress = get_monotonic_ns();
+    int stalled = 0;
+
+    while (!__atomic_load_n(&stress_watchdog_quit, __ATOMIC_ACQUIRE)) {
+        int64_t now = get_monotonic_ns();
+
+        for (int i = 0; i <= STRESS_OPS; i++) {
+            int64_t started = __atomic_load_n(&stress_slots[i].started, __ATOMIC_ACQUIRE);
+            if (started && now - started > STRESS_DEADLOCK_MS * SPA_NSEC_PER_MSEC) {
+                stress_report_stuck(i, now);
+            }
+        }
+
+        // A failed stream asked for its stop, that is not the plugin hanging
+        uint64_t read = __atomic_load_n(&stress_bytes_read, __ATOMIC_RELAXED);
+        int playing = __atomic_load_n(&state, __ATOMIC_ACQUIRE) == DDB_PLAYBACK_STATE_PLAYING
+            && !__atomic_load_n(&stress_stop_pending, __ATOMIC_ACQUIRE);
+        if (read != last_read || !playing) {
+            last_read = read;
+            last_progress = now;
+            stalled = 0;
+        } else if (!stalled && now - last_progress > STRESS_STALL_MS * SPA_NSEC_PER_MSEC) {
+            stalled = 1;
+            __atomic_fetch_add(&stress_stalls, 1, __ATOMIC_RELAXED);
+            fprintf(stderr, "stuck stream: playing, nothing read for %d ms, format switch %s\n", STRESS_STALL_MS,
+                __atomic_load_n(&_setformat_requested, __ATOMIC_ACQUIRE) ? "pending" : "idle");
+        }
+        stress_sleep_ms(STRESS_WATCHDOG_MS);
+    }
+}
+
+static void stress_print_hist(const char *name, uint64_t n, uint64_t sum_ns, uint64_t max_ns, const uint64_t *hist, int buckets, const char *unit) {
+    if (!n) {
+        printf("%-10s never\n", name);
+        return;
+    }
+    printf("%-10s %8" PRIu64 " calls, avg %.3f ms, max %.3f ms\n", name, n, sum_ns / 1e6 / n, max_ns / 1e6);
+    for (int i = 0; i < buckets; i++) {
+        if (!hist[i]) {
+            continue;
+        }
+        int bar = (int)(hist[i] * 50 / n);
+        printf("    < %6u %s %8" PRIu64 " %5.1f%% %.*s\n", 1u << i, unit, hist[i], hist[i] * 100.0 / n,
+            bar ? bar : 1, "##################################################");
+    }
+}
+
+int main(int argc, char **argv) {
+    int seconds = STRESS_DEFAULT_SECONDS;
+    struct stress_sink sink;
+    intptr_t threads[STRESS_OPS];
+    intptr_t watchdog;
+
+    for (int i = 1; i < argc; i++) {
+        char *eq = strchr(argv[i], '=');
+        if (eq) {
+            *eq = 0;
+            stress_conf_set(argv[i], eq + 1);
+        } else if (!strcmp(argv[i], "-v")) {
+            stress_verbose = 1;
+        } else if (atoi(argv[i]) > 0) {
+            seconds = atoi(argv[i]);
+        } else {
+            fprintf(stderr, "usage: %s [-v] [seconds] [key=value ...]\n", argv[0]);
+            return 1;
+        }
+    }
+    // Plays into the null sink unless another target was given
+    if (!stress_conf_find(PW_PLUGIN_ID "_soundcard")) {
+        stress_conf_set(PW_PLUGIN_ID "_soundcard", STRESS_SINK_NAME);
+    }
+
+    pw_init(&argc, &argv);
+    if (stress_sink_create(&sink) < 0) {
+        stress_sink_destroy(&sink);
+        pw_deinit();
+        return 1;
+    }
+
+    stress_fmt = stress_formats[0];
+    DB_plugin_t *p = ddb_out_pw_load(&stress_api);
+    p->start();
+    plugin.setformat(&stress_fmt);
+
+    printf("%d s against %s, deadlock after %d ms, stuck stream after %d ms\n\n", seconds,
+        stress_conf_find(PW_PLUGIN_ID "_soundcard"), STRESS_DEADLOCK_MS, STRESS_STALL_MS);
+    watchdog = stress_thread_start(stress_watchdog, NULL);
+    for (int i = 0; i < STRESS_OPS; i++) {
+        threads[i] = stress_thread_start(stress_thread, (void *)(intptr_t)i);
+    }
+    stress_sleep_ms(seconds * 1000);
+    __atomic_store_n(&stress_quit, 1, __ATOMIC_RELEASE);
+    for (int i = 0; i < STRESS_OPS; i++) {
+        stress_thread_join(threads[i]);
+    }
+
+    // The watchdog keeps an eye on the final stop too
+    stress_begin(STRESS_STOP, STRESS_STOP);
+    plugin.stop();
+    stress_end(STRESS_STOP, STRESS_STOP);
+    __atomic_store_n(&stress_watchdog_quit, 1, __ATOMIC_RELEASE);
+    stress_thread_join(watchdog);
+
+    printf("calls, time until the caller got control back\n");
+    for (int i = 0; i < STRESS_OPS; i++) {
+        struct stress_hist *h = &stress_hists[i];
+        stress_print_hist(stress_ops[i].name, h->n, h->sum_ns, h->max_ns, h->hist, STRESS_BUCKETS, "us");
+    }
+    printf("\ntransitions, time until heard\n");
+    for (int i = 0; i < DDBPW_TRANSITIONS; i++) {
+        struct transition_stats *t = &transitions[i];
+        stress_print_hist(transition_names[i], t->n, t->sum_ns, t->max_ns, t->hist, DDBPW_TRANSITION_BUCKETS, "ms");
+    }
+    printf("\n%" PRIu64 " stuck streams, %" PRIu64 " stops requested by the plugin\n", stress_stalls, stress_stop_events);
+
+    p->stop();
+    stress_sink_destroy(&sink);
+    pw_deinit();
+    return stress_stalls ? 2 : 0;
+}
@@ -0,0 +1,173 @@
+/*
+    PipeWire output plugin for DeaDBeeF Player
+    Copyright (C) 2020 Nicolai Syvertsen <saivert@saivert.com>
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/* Prints the timeline of a trace written by the PipeWire output plugin.
+ *
+ *   $ ddbpw-trace /tmp/ddb_out_pw.trace
+ *
+ * Each line shows the time since the first event, the time since the
+ * previous event of the same role, the role and the event.
+ */
+
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "ddbpw_trace.h"
+
+static const char *role_names[DDBPW_TRACE_ROLES] = { "rt", "loop", "feeder", "caller" };
+
+// pw_stream_state runs from -1 (error) to 4 (streaming)
+static const char *stream_states[] = { "error", "unconnected", "connecting", "paused", "streaming" };
+
+static const char *stream_state(uint32_t s) {
+    int i = (int32_t)s + 1;
+    return i >= 0 && i < (int)(sizeof(stream_states) / sizeof(stream_states[0])) ? stream_states[i] : "?";
+}
+
+static void print_event(const ddbpw_trace_event *e) {
+    float f;
+
+    switch (e->type) {
+    case DDBPW_EV_PROCESS:
+        printf("process %u frames, %u requested, %u from ring%s", e->a, e->b, e->c, e->c < e->a ? " UNDERRUN" : "");
+        break;
+    case DDBPW_EV_NO_BUFFER:
+        printf("no buffer");
+        break;
+    case DDBPW_EV_DRAINED:
+        printf("old format drained, %u bytes left", e->a);
+        break;
+    case DDBPW_EV_FEEDER_READ:
+        printf("streamer read %u bytes, ring had %u", e->a, e->b);
+        break;
+    case DDBPW_EV_FEEDER_WAKE:
+        printf("feeder woke after %u us", e->a);
+        break;
+    case DDBPW_EV_STREAM_STATE:
+        printf("stream %s -> %s", stream_state(e->a), stream_state(e->b));
+        break;
+    case DDBPW_EV_NOTIFY:
+        printf("notify 0x%x", e->a);
+        break;
+    case DDBPW_EV_FORMAT_APPLIED:
+        printf("format applied %uHz %ubit %uch%s", e->a, e->b & 0xff, e->b >> 8, e->c ? " (flushed)" : "");
+        break;
+    case DDBPW_EV_CONTROL:
+        memcpy(&f, &e->c, sizeof(f));
+        printf("control %u, %u values, first %f", e->a, e->b, f);
+        break;
+    case DDBPW_EV_LATENCY:
+        printf("latency %u ms", e->a);
+        break;
+    case DDBPW_EV_SETFORMAT:
+        printf("setformat %uHz %ubit %uch", e->a, e->b & 0xff, e->b >> 8);
+        break;
+    case DDBPW_EV_PLAY:
+        printf("play%s", e->a ? " (warm)" : "");
+        break;
+    case DDBPW_EV_PAUSE:
+        printf("pause%s", e->a ? " (warm)" : "");
+        break;
+    case DDBPW_EV_UNPAUSE:
+        printf("unpause");
+        break;
+    case DDBPW_EV_STOP:
+        printf("stop%s", e->a ? " (parked)" : "");
+        break;
+    case DDBPW_EV_SEEK:
+        printf("seek%s", e->a ? " (short quantum)" : "");
+        break;
+    case DDBPW_EV_OVERRUN:
+        printf("*** %u events lost ***", e->a);
+        break;
+    default:
+        printf("unknown event %u (%u %u %u)", e->type, e->a, e->b, e->c);
+        break;
+    }
+}
+
+static int compare_events(const void *a, const void *b) {
+    const ddbpw_trace_event *x = a, *y = b;
+    return x->ts < y->ts ? -1 : x->ts > y->ts;
+}
+
+int main(int argc, char **argv) {
+    ddbpw_trace_header h;
+    ddbpw_trace_event *events = NULL;
+    size_t n = 0, size = 0;
+
+    if (argc != 2) {
+        fprintf(stderr, "usage: %s TRACEFILE\n", argv[0]);
+        return 1;
+    }
+
+    FILE *f = fopen(argv[1], "rb");
+    if (!f) {
+        perror(argv[1]);
+        return 1;
+    }
+    if (fread(&h, sizeof(h), 1, f) != 1 || memcmp(h.magic, DDBPW_TRACE_MAGIC, sizeof(h.magic))) {
+        fprintf(stderr, "%s: not a PipeWire output plugin trace\n", argv[1]);
+        return 1;
+    }
+    if (h.version != DDBPW_TRACE_VERSION || h.event_size != sizeof(ddbpw_trace_event)) {
+        fprintf(stderr, "%s: trace version %u with %u byte events, this decoder reads version %d\n",
+            argv[1], h.version, h.event_size, DDBPW_TRACE_VERSION);
+        return 1;
+    }
+
+    for (;;) {
+        if (n == size) {
+            size = size ? size * 2 : 4096;
+            if (!(events = realloc(events, size * sizeof(*events)))) {
+                fprintf(stderr, "out of memory\n");
+                return 1;
+            }
+        }
+        if (fread(&events[n], sizeof(*events), 1, f) != 1) {
+            break;
+        }
+        n++;
+    }
+    fclose(f);
+
+    // Rings are flushed one after the other, put them back on one timeline
+    qsort(events, n, sizeof(*events), compare_events);
+
+    uint64_t last[DDBPW_TRACE_ROLES] = { 0 };
+    for (size_t i = 0; i < n; i++) {
+        const ddbpw_trace_event *e = &events[i];
+        uint32_t role = e->role < DDBPW_TRACE_ROLES ? e->role : DDBPW_TRACE_CALLER;
+
+        printf("%12.3f ms ", (e->ts - events[0].ts) / 1e6);
+        if (last[role]) {
+            printf("%+10.3f ", (e->ts - last[role]) / 1e6);
+        } else {
+            printf("%10s ", "");
+        }
+        printf("%-6s ", role_names[role]);
+        print_event(e);
+        printf("\n");
+        last[role] = e->ts;
+    }
+
+    free(events);
+    return 0;
+}
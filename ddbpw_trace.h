@@ -0,0 +1,101 @@
+/*
+    PipeWire output plugin for DeaDBeeF Player
+    Copyright (C) 2020 Nicolai Syvertsen <saivert@saivert.com>
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/* Binary trace format shared by the plugin and ddbpw-trace.
+ *
+ * A trace file is a ddbpw_trace_header followed by ddbpw_trace_event
+ * records, in the order they were flushed. Events of one ring are in time
+ * order, events of different rings interleave and are sorted by the
+ * decoder. All fields are in host byte order.
+ */
+
+#ifndef DDBPW_TRACE_H
+#define DDBPW_TRACE_H
+
+#include <stdint.h>
+
+#define DDBPW_TRACE_MAGIC "DDBPWTRC"
+#define DDBPW_TRACE_VERSION 1
+
+typedef struct {
+    char magic[8];
+    uint32_t version;
+    uint32_t event_size;
+} ddbpw_trace_header;
+
+// One ring per role, each with a single writer except the caller ring
+enum {
+    DDBPW_TRACE_RT,
+    DDBPW_TRACE_LOOP,
+    DDBPW_TRACE_FEEDER,
+    DDBPW_TRACE_CALLER,
+    DDBPW_TRACE_ROLES
+};
+
+enum {
+    // a: frames written, b: frames requested by the graph, c: frames taken from the ring
+    DDBPW_EV_PROCESS = 1,
+    // Nothing to dequeue
+    DDBPW_EV_NO_BUFFER,
+    // The old format ran dry, a: bytes left in the ring
+    DDBPW_EV_DRAINED,
+    // a: bytes read from the streamer, b: ring fill before the read
+    DDBPW_EV_FEEDER_READ,
+    // a: microseconds from on_process kicking the feeder until it ran
+    DDBPW_EV_FEEDER_WAKE,
+    // a: old pw_stream_state, b: new pw_stream_state
+    DDBPW_EV_STREAM_STATE,
+    // a: notify bits picked up by the loop
+    DDBPW_EV_NOTIFY,
+    // a: rate, b: bps | channels << 8, c: 1 when the old format was flushed
+    DDBPW_EV_FORMAT_APPLIED,
+    // a: control id, b: number of values, c: first value as float bits
+    DDBPW_EV_CONTROL,
+    // a: new quantum in ms
+    DDBPW_EV_LATENCY,
+    // a: rate, b: bps | channels << 8
+    DDBPW_EV_SETFORMAT,
+    // a: 1 for a warm start from a parked connection
+    DDBPW_EV_PLAY,
+    // a: 1 for a warm pause
+    DDBPW_EV_PAUSE,
+    DDBPW_EV_UNPAUSE,
+    // a: 1 when the connection was parked
+    DDBPW_EV_STOP,
+    // Written when a ring wrapped before it was flushed, a: events lost
+    DDBPW_EV_OVERRUN,
+    // a: 1 while the short seek quantum is in place
+    DDBPW_EV_SEEK,
+    DDBPW_EV_LAST
+};
+
+typedef struct {
+    uint64_t ts;        // CLOCK_MONOTONIC ns
+    uint16_t type;
+    uint16_t role;
+    uint32_t a;
+    uint32_t b;
+    uint32_t c;
+} ddbpw_trace_event;
+
+/* Records are written and read as raw bytes, any padding would change the
+ * file format. C99 has no static assert, a negative array size stands in. */
+typedef char ddbpw_trace_event_size_check[sizeof(ddbpw_trace_event) == 24 ? 1 : -1];
+typedef char ddbpw_trace_header_size_check[sizeof(ddbpw_trace_header) == 16 ? 1 : -1];
+
+#endif
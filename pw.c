@@ -16,18 +16,39 @@
     along with this program.  If not, see <http://www.gnu.org/licenses/>.
 */
 
+#define _GNU_SOURCE
+
 #include <spa/param/audio/format-utils.h>
 #include <spa/param/props.h>
 #include <pipewire/pipewire.h>
+#include <pipewire/extensions/metadata.h>
 
 #include <errno.h>
+#include <inttypes.h>
+#include <limits.h>
+#include <math.h>
+#include <pthread.h>
+#include <sched.h>
+#include <semaphore.h>
+#include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <stdbool.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#define DDBPW_HAVE_X86_SIMD
+#endif
 #ifdef DDB_IN_TREE
 #include "../../deadbeef.h"
 #else
 #include <deadbeef/deadbeef.h>
 #endif
+#include "ddb_output_pw.h"
+#include "ddbpw_trace.h"
 
 #define OP_ERROR_SUCCESS 0
 #define OP_ERROR_INTERNAL -1
@@ -36,13 +57,105 @@
 #define DDBPW_DEFAULT_VOLUMECONTROL 0
 #define CONFSTR_DDBPW_REMOTENAME "pipewire.remotename"
 #define CONFSTR_DDBPW_PROPS "pipewire.properties"
+#define CONFSTR_DDBPW_MIRRORS "pipewire.mirrors"
+#define DDBPW_MAX_MIRRORS 8
 #define DDBPW_DEFAULT_REMOTENAME ""
+#define CONFSTR_DDBPW_MEDIANAME "pipewire.medianame"
+#define DDBPW_DEFAULT_MEDIANAME "[%artist% - ]%title%"
+#define CONFSTR_DDBPW_MEDIAPROPS "pipewire.mediaprops"
+#define DDBPW_MAX_MEDIAPROPS 8
 
 
 #ifdef ENABLE_BUFFER_OPTION
 #define CONFSTR_DDBPW_BUFLENGTH "pipewire.buflength"
 #endif
 #define DDBPW_DEFAULT_BUFLENGTH 25
+// Buffer pool, 0 leaves the choice to PipeWire
+#define CONFSTR_DDBPW_NBUFFERS "pipewire.buffers"
+#define DDBPW_DEFAULT_NBUFFERS 0
+#define CONFSTR_DDBPW_BUFFERSIZE "pipewire.buffersize"
+#define DDBPW_DEFAULT_BUFFERSIZE 0
+#define DDBPW_MAX_NBUFFERS 64
+#define CONFSTR_DDBPW_ADAPTIVE "pipewire.adaptivelatency"
+#define DDBPW_DEFAULT_ADAPTIVE 0
+#define CONFSTR_DDBPW_ADAPTIVE_MIN "pipewire.adaptivelatency.min"
+#define DDBPW_DEFAULT_ADAPTIVE_MIN 10
+#define CONFSTR_DDBPW_ADAPTIVE_MAX "pipewire.adaptivelatency.max"
+#define DDBPW_DEFAULT_ADAPTIVE_MAX 200
+// Underruns per second that make the controller double the latency
+#define DDBPW_ADAPTIVE_UNDERRUNS 2
+// Seconds without any underrun before it tries a smaller latency again
+#define DDBPW_ADAPTIVE_STABLE_SECS 30
+// Long quantum once playback has gone undisturbed for a while, the graph may cap it at its clock.max-quantum
+#define CONFSTR_DDBPW_POWERSAVE "pipewire.powersave"
+#define DDBPW_DEFAULT_POWERSAVE 0
+#define CONFSTR_DDBPW_POWERSAVE_LATENCY "pipewire.powersave.latency"
+#define DDBPW_DEFAULT_POWERSAVE_LATENCY 500
+#define CONFSTR_DDBPW_POWERSAVE_DELAY "pipewire.powersave.delay"
+#define DDBPW_DEFAULT_POWERSAVE_DELAY 15
+// Quantum right after a seek so the new position is heard quickly, held until the ring had time to refill
+#define CONFSTR_DDBPW_SEEKLATENCY "pipewire.seeklatency"
+#define DDBPW_DEFAULT_SEEKLATENCY 10
+#define DDBPW_SEEK_HOLD_MS 250
+// If the new position is never heard, the short quantum still ends after this
+#define DDBPW_SEEK_FALLBACK_MS 2000
+#define DDBPW_LATENCY_HISTORY 16
+#define CONFSTR_DDBPW_NATIVEFORMAT "pipewire.nativeformat"
+#define DDBPW_DEFAULT_NATIVEFORMAT 0
+#define DDBPW_SINK_MAX_RATES 16
+#define CONFSTR_DDBPW_PREROLL "pipewire.preroll"
+#define DDBPW_DEFAULT_PREROLL 0
+// Start anyway when the streamer cannot fill the preroll this much later, e.g. on a very short track
+#define DDBPW_PREROLL_TIMEOUT_MS 500
+#define CONFSTR_DDBPW_KEEPCONNECTED "pipewire.keepconnected"
+#define DDBPW_DEFAULT_KEEPCONNECTED 0
+#define CONFSTR_DDBPW_WARMPAUSE "pipewire.warmpause"
+#define DDBPW_DEFAULT_WARMPAUSE 0
+#define CONFSTR_DDBPW_BITPERFECT "pipewire.bitperfect"
+#define DDBPW_DEFAULT_BITPERFECT 0
+#define CONFSTR_DDBPW_CONVERT "pipewire.convert"
+#define DDBPW_DEFAULT_CONVERT 0
+#define CONFSTR_DDBPW_METERPROPS "pipewire.meterprops"
+#define DDBPW_DEFAULT_METERPROPS 0
+#define CONFSTR_DDBPW_STATSINTERVAL "pipewire.statsinterval"
+#define DDBPW_DEFAULT_STATSINTERVAL 10
+#define CONFSTR_DDBPW_RINGLENGTH "pipewire.ringlength"
+#define DDBPW_DEFAULT_RINGLENGTH 100
+
+#define DDBPW_CACHELINE 64
+/* Ring capacity is fixed at init for the highest rate and widest frame below.
+ * The RT thread reads the ring without a lock, so it is never reallocated
+ * while a stream is up. One channel per DeaDBeeF speaker bit. */
+#define DDBPW_RING_MAX_RATE 192000
+#define DDBPW_RING_MAX_CHANNELS 18
+#define DDBPW_RING_MAX_STRIDE (DDBPW_RING_MAX_CHANNELS * 4)
+#define DDBPW_FEEDER_CHUNK 16384
+#define DDBPW_FEEDER_WAIT_MS 10
+// Samples converted to float per deinterleave step, small enough to stay in L1
+#define DDBPW_PLANAR_CHUNK 2048
+#define CONFSTR_DDBPW_FEEDER_POLICY "pipewire.feeder.policy"
+#define DDBPW_DEFAULT_FEEDER_POLICY 0
+#define CONFSTR_DDBPW_FEEDER_PRIORITY "pipewire.feeder.priority"
+#define DDBPW_DEFAULT_FEEDER_PRIORITY 10
+#define CONFSTR_DDBPW_FEEDER_NICE "pipewire.feeder.nice"
+#define DDBPW_DEFAULT_FEEDER_NICE 0
+#define CONFSTR_DDBPW_FEEDER_CPUS "pipewire.feeder.cpus"
+#define DDBPW_DEFAULT_FEEDER_CPUS ""
+#define CONFSTR_DDBPW_TRACE "pipewire.trace"
+#ifdef DDBPW_DEBUG
+#define DDBPW_DEFAULT_TRACE 1
+#else
+#define DDBPW_DEFAULT_TRACE 0
+#endif
+#define CONFSTR_DDBPW_TRACEFILE "pipewire.tracefile"
+#define DDBPW_DEFAULT_TRACEFILE "/tmp/ddb_out_pw.trace"
+// Events per trace ring, a power of two. With a 10 ms quantum the RT ring covers over a minute.
+#define DDBPW_TRACE_EVENTS 8192
+#define DDBPW_TRACE_FLUSH_SECS 1
+// Give up waiting for the old format to drain after the ring length plus this
+#define DDBPW_FORMAT_DRAIN_SLACK_MS 250
+// How soon the loop looks again when a format switch finds a process callback still running
+#define DDBPW_FORMAT_RETRY_MS 1
 
 #ifdef DDBPW_DEBUG
 #define trace(...) { fprintf(stdout, __VA_ARGS__); }
@@ -63,22 +176,387 @@ static const char application_id[] = "music.deadbeef.player";
 
 static char *tfbytecode;
 
+// Extra key=titleformat pairs published with every track, guarded by mutex like tfbytecode
+struct media_tf {
+    char key[64];
+    char *bytecode;
+};
+static struct media_tf media_tfs[DDBPW_MAX_MEDIAPROPS];
+static int n_media_tfs;
+static char media_conf[1024];
+static char media_name_conf[256];
+
 static ddb_waveformat_t requested_fmt;
 static ddb_playback_state_t state=DDB_PLAYBACK_STATE_STOPPED;
 static uintptr_t mutex;
+/* One transition at a time: play, stop, pause, unpause, setformat, free and
+ * the messages that reach the loop. DeaDBeeF calls them from the streamer,
+ * the main thread and GUI threads, and a stop must not tear the loop down
+ * under any of them. Taken before the loop lock. */
+static uintptr_t ctl_mutex;
+// Set on the feeder, setformat from inside streamer_read must not wait for a stop that is joining it
+static __thread int feeder_thread_self;
 static int _setformat_requested;
 static float _initialvol;
 static int _buffersize;
 static int _stride;
+static int _ringlength;
+static int _bitperfect;
+static int _nativeformat;
+
+enum {
+    DDBPW_CONVERT_OFF,
+    DDBPW_CONVERT_F32,
+    DDBPW_CONVERT_S24_32,
+    DDBPW_CONVERT_F32P,
+};
+
+typedef void (*convert_func_t)(void *dst, const void *src, uint32_t n_samples);
+typedef void (*deinterleave_func_t)(float *const *dst, uint32_t offset, const float *src, uint32_t channels, uint32_t n_frames);
+typedef void (*meter_func_t)(const float *src, uint32_t channels, uint32_t n_frames, float *peak, double *sumsq);
+
+// Optional conversion applied while copying out of the ring, chosen in ddbpw_set_spec
+static convert_func_t _convert;
+static int _out_stride;
+
+// Planar F32 output writes one datas[] plane per channel, _out_stride still counts a whole frame
+static int _planar;
+static deinterleave_func_t _deinterleave;
+static meter_func_t _meter_f32;
+
+/* Single-producer byte ring between the feeder thread and the RT process
+ * callbacks. Indices run freely and are wrapped with the mask, so size is
+ * always a power of two. Each index sits on its own cache line. readindex
+ * belongs to the main stream and is the only one the producer waits for,
+ * mirror streams keep their own index next to their stream. */
+struct ring {
+    uint32_t writeindex SPA_ALIGNED(DDBPW_CACHELINE);
+    uint32_t readindex SPA_ALIGNED(DDBPW_CACHELINE);
+    uint32_t size SPA_ALIGNED(DDBPW_CACHELINE);
+    uint32_t mask;
+    uint8_t *buffer;
+};
+
+#define DDBPW_STATS_BUCKETS 8
+// Processing cost buckets, <256 ns then one per power of two up to 1 ms and over
+#define DDBPW_COST_BUCKETS 14
+
+/* Written only by the RT thread, read by the stats timer on the loop thread.
+ * Counters are cumulative, the reporter diffs them against its last copy. */
+struct stats {
+    uint64_t callbacks;
+    uint64_t no_buffer;
+    uint64_t underruns;
+    uint64_t frames_requested;
+    uint64_t frames_delivered;
+    uint64_t requested_hist[DDBPW_STATS_BUCKETS];
+    uint64_t delivered_hist[DDBPW_STATS_BUCKETS];
+    uint64_t jitter_sum;
+    uint64_t jitter_max;
+    int64_t delay;
+    uint64_t queued;
+    uint64_t buffered;
+    int64_t last_callback;
+    uint32_t graph_rate;
+
+    uint64_t cost_ns;
+    uint64_t cost_cycles;
+    uint64_t cost_frames;
+    uint64_t cost_max;
+    uint64_t cost_hist[DDBPW_COST_BUCKETS];
+
+    // Time from on_process kicking the feeder until it runs, written by the feeder
+    uint64_t feeder_wakeups;
+    uint64_t feeder_wake_ns;
+    uint64_t feeder_wake_max;
+    uint64_t feeder_wake_hist[DDBPW_COST_BUCKETS];
+};
+
+#define STAT_GET(field) __atomic_load_n(&(field), __ATOMIC_RELAXED)
+#define STAT_SET(field, v) __atomic_store_n(&(field), (v), __ATOMIC_RELAXED)
+// A read-modify-write, so a counter bumped from more than one thread loses nothing
+#define STAT_ADD(field, v) __atomic_fetch_add(&(field), (v), __ATOMIC_RELAXED)
+
+/* Extra stream playing the same audio on another sink. It reads the shared
+ * ring through its own index and never holds up the feeder; if it falls too
+ * far behind it jumps to where the main stream is. */
+struct mirror {
+    uint32_t readindex SPA_ALIGNED(DDBPW_CACHELINE);
+    int flush;
+    uint32_t resyncs;
+    struct pw_stream *stream;
+    struct spa_hook listener;
+    int latency_ms;
+    // Fixed gain, the main volume only goes to the main stream
+    float volume;
+    char target[256];
+};
+
+// Bits the RT thread sets in data.notify before signalling notify_event
+#define DDBPW_NOTIFY_DRAINED (1 << 0)
+#define DDBPW_NOTIFY_FIRST_SAMPLE (1 << 1)
+#define DDBPW_NOTIFY_VOLUME (1 << 2)
+#define DDBPW_NOTIFY_VERIFY (1 << 3)
+#define DDBPW_NOTIFY_PAUSED (1 << 4)
+#define DDBPW_NOTIFY_RESUMED (1 << 5)
+#define DDBPW_NOTIFY_LATENCY (1 << 6)
+#define DDBPW_NOTIFY_STARTED (1 << 7)
+#define DDBPW_NOTIFY_PREROLLED (1 << 8)
+#define DDBPW_NOTIFY_METER (1 << 9)
+#define DDBPW_NOTIFY_WAKE (1 << 10)
+#define DDBPW_NOTIFY_SEEKED (1 << 11)
+
+// Weight of a new sample in the smoothed output latency, and how far it moves before we tell anyone
+#define DDBPW_LATENCY_SMOOTH 16
+#define DDBPW_LATENCY_REPORT_NS (2 * SPA_NSEC_PER_MSEC)
+
+// Meter window, how long the meter keeps running after the last reader, and how often it goes into stream properties
+#define DDBPW_METER_WINDOW_MS 50
+#define DDBPW_METER_IDLE_NS (2 * SPA_NSEC_PER_SEC)
+#define DDBPW_METER_PROPS_NS (250 * SPA_NSEC_PER_MSEC)
 
 struct data {
     struct pw_thread_loop *loop;
+    struct pw_context *context;
+    struct pw_core *core;
+    struct spa_hook core_listener;
+    int core_error;
     struct pw_stream *stream;
+    struct spa_hook stream_listener;
     int pw_has_init;
+
+    // Stop only disconnects the streams when keepconnected is set, the rest stays for the next play
+    int parked;
+    char conf_sig[2048];
+    int64_t play_requested;
+    int64_t play_first_sample;
+    int play_warm;
+
+    // Streams connect inactive until the feeder has this much in the ring
+    int prerolling;
+    int preroll_ms;
+    uint32_t preroll_bytes;
+    uint32_t preroll_filled;
+    int64_t preroll_done;
+
+    struct mirror mirrors[DDBPW_MAX_MIRRORS];
+    int n_mirrors;
+
+    struct ring ring;
+    uint32_t ring_target;
+    // Lowered by the RT side, reset from the loop, atomic
+    uint32_t ring_lowwater;
+    // Where the next flush stops, atomic, a new flush may move it while the RT side reads it
+    uint32_t ring_flush_to;
+    int ring_flush;
+
+    intptr_t feeder_tid;
+    int feeder_quit;
+    sem_t feeder_sem;
+    // Set by on_process when it posts feeder_sem, cleared by the feeder before it sleeps
+    int64_t feeder_kick;
+    char feeder_chunk[DDBPW_FEEDER_CHUNK];
+
+    struct stats stats;
+    struct stats stats_prev;
+    struct spa_source *stats_timer;
+
+    struct spa_source *notify_event;
+    int notify;
+
+    // Built on the caller's thread, published by the loop. media_sent is owned by the caller.
+    struct pw_properties *media_pending;
+    struct pw_properties *media_sent;
+    uint64_t media_updates;
+    uint64_t media_skipped;
+
+    // Latest volume from DeaDBeEF, picked up by the next quantum
+    float volume_pending;
+    int volume_dirty;
+    float volume_applied;
+    uint64_t volume_events;
+    uint64_t volume_updates;
+
+    // Output latency as seen by DeaDBeeF, written by the RT thread under a seqlock
+    ddb_pw_latency_t out_latency;
+    uint32_t out_latency_seq;
+    int64_t out_latency_reported;
+
+    // Level meter. It only runs while meter_wanted is recent or meter_props is set,
+    // the window belongs to the RT thread, the snapshot is under a seqlock.
+    int64_t meter_wanted;
+    int meter_props;
+    int meter_running;
+    float meter_peak[DDB_PW_METER_CHANNELS];
+    double meter_sumsq[DDB_PW_METER_CHANNELS];
+    uint32_t meter_frames;
+    ddb_pw_meter_t meter;
+    uint32_t meter_seq;
+    int64_t meter_props_sent;
+
+    // Warm pause keeps the stream running on silence and the ring untouched
+    int paused;
+    int warm_pause;
+    int64_t pause_requested;
+    int64_t pause_silent;
+    int64_t unpause_requested;
+    int64_t first_sound;
+
+    // What set_spec offered, checked against the negotiated format in bit-perfect mode
+    struct spa_audio_info_raw offered;
+    int verify_rate;
+
+    int nbuffers;
+    int buffer_ms;
+    uint32_t buffers_added;
+    uint64_t buffer_bytes;
+
+    struct spa_source *format_timer;
+    int64_t format_requested;
+    int64_t format_applied;
+    int64_t format_first_sample;
+    /* Set while the loop swaps format globals, on_process stays out and
+     * in_process counts callbacks inside. format_flush remembers a deferred
+     * switch that has to flush. */
+    int format_switching;
+    int format_flush;
+    int in_process;
+
+    int latency_ms;
+    int latency_min_ms;
+    int latency_max_ms;
+    int adaptive;
+    int stable_secs;
+    uint64_t latency_underruns;
+    struct spa_source *latency_timer;
+    struct spa_source *trace_timer;
+
+    // Power saving, owned by the loop except powersave_reason which callers hand over with DDBPW_NOTIFY_WAKE
+    int powersave;
+    int powersave_ms;
+    int powersave_delay;
+    int powersave_active;
+    int powersave_secs;
+    int powersave_restore_ms;
+    uint64_t powersave_underruns;
+    const char *powersave_reason;
+    struct spa_source *powersave_timer;
+    // Process callbacks and playing time in each mode, [0] normal and [1] long quantum
+    uint64_t mode_callbacks[2];
+    int64_t mode_ns[2];
+    uint64_t mode_callbacks_mark;
+    int64_t mode_mark;
+
+    // A seek flushes what was queued and runs at seek_ms until seek_timer brings back seek_restore_ms.
+    // DB_EV_SEEK bumps seek_gen, the feeder records in seek_mark where its first read under a new
+    // seek_mark_gen went into the ring, and ddbpw_seeked flushes up to there once per generation.
+    int seek_ms;
+    int seek_active;
+    int seek_restore_ms;
+    uint32_t seek_gen;
+    uint32_t seek_gen_flushed;
+    uint32_t seek_mark_gen;
+    uint32_t seek_mark;
+    int64_t seek_requested;
+    int64_t seek_flushed;
+    int64_t seek_first_sound;
+    struct spa_source *seek_timer;
+    int latency_history[DDBPW_LATENCY_HISTORY];
+    int n_latency_history;
 };
 
 struct data data = { 0, };
 
+// Sample formats a sink takes, limited to what DeaDBeeF can hand us
+enum {
+    DDBPW_SINK_S16 = 1 << 0,
+    DDBPW_SINK_S24 = 1 << 1,
+    DDBPW_SINK_S32 = 1 << 2,
+    DDBPW_SINK_F32 = 1 << 3,
+};
+
+/* What the sink's EnumFormat params say it accepts. Lives apart from
+ * struct sink so the node listener keeps a stable pointer when the sink
+ * array grows. */
+struct sink_probe {
+    struct sink_cache *c;
+    struct pw_proxy *proxy;
+    struct spa_hook listener;
+
+    int valid;
+    uint32_t formats;
+    uint32_t rates[DDBPW_SINK_MAX_RATES];
+    int n_rates;
+    uint32_t rate_min;
+    uint32_t rate_max;
+};
+
+struct sink {
+    uint32_t id;
+    char *name;
+    char *desc;
+    struct sink_probe *probe;
+};
+
+/* Audio/Sink and Audio/Duplex nodes, kept up to date by a registry listener
+ * on its own thread loop so enumeration never has to round-trip the daemon. */
+struct sink_cache {
+    struct pw_thread_loop *loop;
+    struct pw_context *context;
+    struct pw_core *core;
+    struct pw_registry *registry;
+    struct spa_hook core_listener;
+    struct spa_hook registry_listener;
+    struct pw_metadata *metadata;
+    struct spa_hook metadata_listener;
+    char default_sink[256];
+    int sync_seq;
+    int synced;
+    int error;
+    char remote[256];
+
+    uintptr_t conn_mutex;
+    uintptr_t mutex;
+    struct sink *sinks;
+    int n_sinks;
+    int max_sinks;
+};
+
+static struct sink_cache sink_cache = { 0, };
+
+// Play to first sample, [0] with a fresh connection and [1] with a parked one. Kept for the plugin's lifetime.
+struct start_times {
+    uint64_t n;
+    int64_t sum_ns;
+};
+static struct start_times start_times[2];
+
+/* Time each playback transition takes until it is heard, kept for the
+ * lifetime of the plugin. Pause and stop count until the caller gets
+ * control back, except warm pause which counts until silence. Seek
+ * counts from the request until the new position is heard. */
+enum {
+    DDBPW_TRANSITION_PLAY,
+    DDBPW_TRANSITION_PAUSE,
+    DDBPW_TRANSITION_UNPAUSE,
+    DDBPW_TRANSITION_FORMAT,
+    DDBPW_TRANSITION_STOP,
+    DDBPW_TRANSITION_SEEK,
+    DDBPW_TRANSITIONS
+};
+
+// Bucket i counts transitions under 1 << i ms
+#define DDBPW_TRANSITION_BUCKETS 12
+
+struct transition_stats {
+    uint64_t n;
+    uint64_t sum_ns;
+    uint64_t max_ns;
+    uint64_t hist[DDBPW_TRANSITION_BUCKETS];
+};
+static struct transition_stats transitions[DDBPW_TRANSITIONS];
+static const char *transition_names[DDBPW_TRANSITIONS] = { "play", "pause", "unpause", "format", "stop", "seek" };
+
 static int ddbpw_init(void);
 
 static int ddbpw_free(void);
@@ -95,268 +573,2252 @@ static int ddbpw_unpause(void);
 
 static int ddbpw_set_spec(ddb_waveformat_t *fmt);
 
-static void my_pw_init(void) {
-    if (data.pw_has_init || state != DDB_PLAYBACK_STATE_STOPPED) {
-        return;
+static void feeder_stop(void);
+
+static void powersave_leave(struct data *data, const char *reason);
+
+static void set_volume(int dolock, float volume);
+
+static void sink_cache_disconnect(struct sink_cache *c);
+
+static int sink_cache_ensure(struct sink_cache *c);
+
+static void sink_native_format(ddb_waveformat_t *fmt);
+
+static int ring_alloc(struct ring *r, uint32_t minsize) {
+    uint32_t size = 1;
+    void *buffer = NULL;
+
+    while (size < minsize) {
+        size <<= 1;
     }
-    pw_init(NULL, NULL);
-    data.pw_has_init = 1;
+    if (posix_memalign(&buffer, DDBPW_CACHELINE, size) != 0) {
+        return -ENOMEM;
+    }
+    // Touch every page now so the RT thread never takes a page fault
+    memset(buffer, 0, size);
+
+    r->buffer = buffer;
+    r->size = size;
+    r->mask = size - 1;
+    r->readindex = 0;
+    r->writeindex = 0;
+    return 0;
 }
 
-static void my_pw_deinit(void) {
-    if (!data.pw_has_init || state != DDB_PLAYBACK_STATE_STOPPED) {
-        return;
+static void ring_free(struct ring *r) {
+    free(r->buffer);
+    r->buffer = NULL;
+    r->size = 0;
+    r->mask = 0;
+}
+
+static uint32_t ring_fill(struct ring *r, uint32_t *readindex) {
+    return __atomic_load_n(&r->writeindex, __ATOMIC_ACQUIRE) - __atomic_load_n(readindex, __ATOMIC_ACQUIRE);
+}
+
+// Producer side. Returns the number of bytes that fit.
+static uint32_t ring_write(struct ring *r, const void *src, uint32_t len) {
+    uint32_t w = __atomic_load_n(&r->writeindex, __ATOMIC_RELAXED);
+    uint32_t rd = __atomic_load_n(&r->readindex, __ATOMIC_ACQUIRE);
+    len = SPA_MIN(len, r->size - (w - rd));
+
+    uint32_t offset = w & r->mask;
+    uint32_t l0 = SPA_MIN(len, r->size - offset);
+    memcpy(r->buffer + offset, src, l0);
+    memcpy(r->buffer, (const uint8_t *)src + l0, len - l0);
+
+    __atomic_store_n(&r->writeindex, w + len, __ATOMIC_RELEASE);
+    return len;
+}
+
+// Consumer side. Never blocks, returns the number of bytes copied.
+static uint32_t ring_read(struct ring *r, uint32_t *readindex, void *dst, uint32_t len) {
+    uint32_t rd = __atomic_load_n(readindex, __ATOMIC_RELAXED);
+    uint32_t w = __atomic_load_n(&r->writeindex, __ATOMIC_ACQUIRE);
+    len = SPA_MIN(len, w - rd);
+
+    uint32_t offset = rd & r->mask;
+    uint32_t l0 = SPA_MIN(len, r->size - offset);
+    memcpy(dst, r->buffer + offset, l0);
+    memcpy((uint8_t *)dst + l0, r->buffer, len - l0);
+
+    __atomic_store_n(readindex, rd + len, __ATOMIC_RELEASE);
+    return len;
+}
+
+// Consumer side. Drops everything written before index.
+static void ring_discard_to(struct ring *r, uint32_t *readindex, uint32_t index) {
+    uint32_t rd = __atomic_load_n(readindex, __ATOMIC_RELAXED);
+    if (index - rd <= r->size) {
+        __atomic_store_n(readindex, index, __ATOMIC_RELEASE);
     }
-    pw_deinit();
-    data.pw_has_init = 0;
 }
 
-static int _apply_format(struct spa_loop *loop,
-        bool async,
-        uint32_t seq,
-        const void *_data,
-        size_t size,
-        void *user_data) {
-    deadbeef->mutex_lock(mutex);
+static uint32_t bytes_to_ms(uint32_t bytes) {
+    if (!_stride || !plugin.fmt.samplerate) {
+        return 0;
+    }
+    return (uint64_t)bytes / _stride * 1000 / plugin.fmt.samplerate;
+}
 
-    pw_stream_disconnect(data.stream);
-    ddbpw_set_spec(&requested_fmt);
-    _setformat_requested = 0;
+static inline int32_t s24_to_s32(const uint8_t *s) {
+    // Leaves the sample in the upper 24 bits, low byte zero
+    return (int32_t)((uint32_t)s[0] << 8 | (uint32_t)s[1] << 16 | (uint32_t)s[2] << 24);
+}
 
-    deadbeef->mutex_unlock(mutex);
+static void convert_s16_f32_c(void *dst, const void *src, uint32_t n_samples) {
+    const int16_t *s = src;
+    float *d = dst;
+    for (uint32_t i = 0; i < n_samples; i++) {
+        d[i] = s[i] * (1.0f / 32768.0f);
+    }
+}
 
-    trace("From inside loop invoke function! %d\n", seq);
-    return 0;
+static void convert_s24_f32_c(void *dst, const void *src, uint32_t n_samples) {
+    const uint8_t *s = src;
+    float *d = dst;
+    for (uint32_t i = 0; i < n_samples; i++, s += 3) {
+        d[i] = s24_to_s32(s) * (1.0f / 2147483648.0f);
+    }
 }
 
-static void on_process(void *userdata) {
-#ifdef DDBPW_DEBUG
-    static int counter;
-#endif
-    struct data *data = userdata;
-    struct pw_buffer *b = NULL;
-    struct spa_buffer *buf = NULL;
-    int16_t *dst = NULL;
+static void convert_s32_f32_c(void *dst, const void *src, uint32_t n_samples) {
+    const int32_t *s = src;
+    float *d = dst;
+    for (uint32_t i = 0; i < n_samples; i++) {
+        d[i] = s[i] * (1.0f / 2147483648.0f);
+    }
+}
 
-    if (!_setformat_requested) {
+static void convert_s16_s24_32_c(void *dst, const void *src, uint32_t n_samples) {
+    const int16_t *s = src;
+    int32_t *d = dst;
+    for (uint32_t i = 0; i < n_samples; i++) {
+        d[i] = (int32_t)s[i] * 256;
+    }
+}
 
-        if ((b = pw_stream_dequeue_buffer(data->stream)) == NULL) {
-            pw_log_warn("out of buffers: %m");
-            return;
-        }
+static void convert_s24_s24_32_c(void *dst, const void *src, uint32_t n_samples) {
+    const uint8_t *s = src;
+    int32_t *d = dst;
+    for (uint32_t i = 0; i < n_samples; i++, s += 3) {
+        d[i] = s24_to_s32(s) >> 8;
+    }
+}
 
-        buf = b->buffer;
-        if ((dst = buf->datas[0].data) == NULL) {
-            return;
-        }
+static void convert_s32_s24_32_c(void *dst, const void *src, uint32_t n_samples) {
+    const int32_t *s = src;
+    int32_t *d = dst;
+    for (uint32_t i = 0; i < n_samples; i++) {
+        d[i] = s[i] >> 8;
+    }
+}
 
-#ifdef ENABLE_BUFFER_OPTION
-        uint32_t buffersize = _buffersize;
-        uint32_t nframes = SPA_MIN(buffersize, buf->datas[0].maxsize/_stride);
+#ifdef DDBPW_HAVE_X86_SIMD
+__attribute__((target("sse2")))
+static void convert_s16_f32_sse2(void *dst, const void *src, uint32_t n_samples) {
+    const int16_t *s = src;
+    float *d = dst;
+    const __m128 scale = _mm_set1_ps(1.0f / 32768.0f);
+    uint32_t i = 0;
+
+    for (; i + 8 <= n_samples; i += 8) {
+        __m128i in = _mm_loadu_si128((const __m128i *)(s + i));
+        __m128i lo = _mm_srai_epi32(_mm_unpacklo_epi16(in, in), 16);
+        __m128i hi = _mm_srai_epi32(_mm_unpackhi_epi16(in, in), 16);
+        _mm_storeu_ps(d + i, _mm_mul_ps(_mm_cvtepi32_ps(lo), scale));
+        _mm_storeu_ps(d + i + 4, _mm_mul_ps(_mm_cvtepi32_ps(hi), scale));
+    }
+    convert_s16_f32_c(d + i, s + i, n_samples - i);
+}
+
+__attribute__((target("sse2")))
+static void convert_s24_f32_sse2(void *dst, const void *src, uint32_t n_samples) {
+    const uint8_t *s = src;
+    float *d = dst;
+    const __m128 scale = _mm_set1_ps(1.0f / 2147483648.0f);
+    uint32_t i = 0;
+
+    // SSE2 has no byte shuffle, assemble the lanes in scalar registers and convert four at a time
+    for (; i + 4 <= n_samples; i += 4, s += 12) {
+        __m128i in = _mm_setr_epi32(s24_to_s32(s), s24_to_s32(s + 3), s24_to_s32(s + 6), s24_to_s32(s + 9));
+        _mm_storeu_ps(d + i, _mm_mul_ps(_mm_cvtepi32_ps(in), scale));
+    }
+    convert_s24_f32_c(d + i, s, n_samples - i);
+}
+
+__attribute__((target("sse2")))
+static void convert_s32_f32_sse2(void *dst, const void *src, uint32_t n_samples) {
+    const int32_t *s = src;
+    float *d = dst;
+    const __m128 scale = _mm_set1_ps(1.0f / 2147483648.0f);
+    uint32_t i = 0;
+
+    for (; i + 4 <= n_samples; i += 4) {
+        __m128i in = _mm_loadu_si128((const __m128i *)(s + i));
+        _mm_storeu_ps(d + i, _mm_mul_ps(_mm_cvtepi32_ps(in), scale));
+    }
+    convert_s32_f32_c(d + i, s + i, n_samples - i);
+}
+
+__attribute__((target("sse2")))
+static void convert_s24_s24_32_sse2(void *dst, const void *src, uint32_t n_samples) {
+    const uint8_t *s = src;
+    int32_t *d = dst;
+    uint32_t i = 0;
+
+    for (; i + 4 <= n_samples; i += 4, s += 12) {
+        __m128i in = _mm_setr_epi32(s24_to_s32(s), s24_to_s32(s + 3), s24_to_s32(s + 6), s24_to_s32(s + 9));
+        _mm_storeu_si128((__m128i *)(d + i), _mm_srai_epi32(in, 8));
+    }
+    convert_s24_s24_32_c(d + i, s, n_samples - i);
+}
+
+__attribute__((target("avx2")))
+static void convert_s16_f32_avx2(void *dst, const void *src, uint32_t n_samples) {
+    const int16_t *s = src;
+    float *d = dst;
+    const __m256 scale = _mm256_set1_ps(1.0f / 32768.0f);
+    uint32_t i = 0;
+
+    for (; i + 8 <= n_samples; i += 8) {
+        __m256i in = _mm256_cvtepi16_epi32(_mm_loadu_si128((const __m128i *)(s + i)));
+        _mm256_storeu_ps(d + i, _mm256_mul_ps(_mm256_cvtepi32_ps(in), scale));
+    }
+    convert_s16_f32_c(d + i, s + i, n_samples - i);
+}
+
+// Spreads eight packed 24-bit samples into the upper three bytes of eight 32-bit lanes
+__attribute__((target("avx2")))
+static inline __m256i load_s24x8_avx2(const uint8_t *s) {
+    const __m256i shuffle = _mm256_setr_epi8(
+        -1, 0, 1, 2, -1, 3, 4, 5, -1, 6, 7, 8, -1, 9, 10, 11,
+        -1, 0, 1, 2, -1, 3, 4, 5, -1, 6, 7, 8, -1, 9, 10, 11);
+    __m256i in = _mm256_inserti128_si256(
+        _mm256_castsi128_si256(_mm_loadu_si128((const __m128i *)s)),
+        _mm_loadu_si128((const __m128i *)(s + 12)), 1);
+    return _mm256_shuffle_epi8(in, shuffle);
+}
+
+__attribute__((target("avx2")))
+static void convert_s24_f32_avx2(void *dst, const void *src, uint32_t n_samples) {
+    const uint8_t *s = src;
+    float *d = dst;
+    const __m256 scale = _mm256_set1_ps(1.0f / 2147483648.0f);
+    uint32_t i = 0;
+
+    // Each step loads 28 bytes, keep the last one inside the source
+    for (; i + 10 <= n_samples; i += 8, s += 24) {
+        _mm256_storeu_ps(d + i, _mm256_mul_ps(_mm256_cvtepi32_ps(load_s24x8_avx2(s)), scale));
+    }
+    convert_s24_f32_c(d + i, s, n_samples - i);
+}
+
+__attribute__((target("avx2")))
+static void convert_s32_f32_avx2(void *dst, const void *src, uint32_t n_samples) {
+    const int32_t *s = src;
+    float *d = dst;
+    const __m256 scale = _mm256_set1_ps(1.0f / 2147483648.0f);
+    uint32_t i = 0;
+
+    for (; i + 8 <= n_samples; i += 8) {
+        __m256i in = _mm256_loadu_si256((const __m256i *)(s + i));
+        _mm256_storeu_ps(d + i, _mm256_mul_ps(_mm256_cvtepi32_ps(in), scale));
+    }
+    convert_s32_f32_c(d + i, s + i, n_samples - i);
+}
+
+__attribute__((target("avx2")))
+static void convert_s24_s24_32_avx2(void *dst, const void *src, uint32_t n_samples) {
+    const uint8_t *s = src;
+    int32_t *d = dst;
+    uint32_t i = 0;
+
+    for (; i + 10 <= n_samples; i += 8, s += 24) {
+        _mm256_storeu_si256((__m256i *)(d + i), _mm256_srai_epi32(load_s24x8_avx2(s), 8));
+    }
+    convert_s24_s24_32_c(d + i, s, n_samples - i);
+}
+#endif
+
+static const struct {
+    int bps;
+    int target;
+    const char *name;
+    convert_func_t c;
+    convert_func_t sse2;
+    convert_func_t avx2;
+} convert_table[] = {
+#ifdef DDBPW_HAVE_X86_SIMD
+    { 16, DDBPW_CONVERT_F32, "s16 -> f32", convert_s16_f32_c, convert_s16_f32_sse2, convert_s16_f32_avx2 },
+    { 24, DDBPW_CONVERT_F32, "s24 -> f32", convert_s24_f32_c, convert_s24_f32_sse2, convert_s24_f32_avx2 },
+    { 32, DDBPW_CONVERT_F32, "s32 -> f32", convert_s32_f32_c, convert_s32_f32_sse2, convert_s32_f32_avx2 },
+    { 24, DDBPW_CONVERT_S24_32, "s24 -> s24_32", convert_s24_s24_32_c, convert_s24_s24_32_sse2, convert_s24_s24_32_avx2 },
 #else
-        uint32_t buffersize = _buffersize;
-        uint32_t nframes = SPA_MIN(buffersize, buf->datas[0].maxsize/_stride);
+    { 16, DDBPW_CONVERT_F32, "s16 -> f32", convert_s16_f32_c, NULL, NULL },
+    { 24, DDBPW_CONVERT_F32, "s24 -> f32", convert_s24_f32_c, NULL, NULL },
+    { 32, DDBPW_CONVERT_F32, "s32 -> f32", convert_s32_f32_c, NULL, NULL },
+    { 24, DDBPW_CONVERT_S24_32, "s24 -> s24_32", convert_s24_s24_32_c, NULL, NULL },
 #endif
+    { 16, DDBPW_CONVERT_S24_32, "s16 -> s24_32", convert_s16_s24_32_c, NULL, NULL },
+    { 32, DDBPW_CONVERT_S24_32, "s32 -> s24_32", convert_s32_s24_32_c, NULL, NULL },
+};
 
-#if PW_CHECK_VERSION(0, 3, 49)
-        if (b->requested != 0) {
-            nframes = SPA_MIN(b->requested, nframes);
+// Picks the fastest kernel the CPU supports, NULL if the format is passed through untouched
+static convert_func_t select_convert(ddb_waveformat_t *fmt, int target) {
+    if (target == DDBPW_CONVERT_OFF || fmt->is_float) {
+        return NULL;
+    }
+
+    for (size_t i = 0; i < SPA_N_ELEMENTS(convert_table); i++) {
+        if (convert_table[i].bps != fmt->bps || convert_table[i].target != target) {
+            continue;
+        }
+#ifdef DDBPW_HAVE_X86_SIMD
+        __builtin_cpu_init();
+        if (convert_table[i].avx2 && __builtin_cpu_supports("avx2")) {
+            trace("PipeWire: converting %s (avx2)\n", convert_table[i].name);
+            return convert_table[i].avx2;
+        }
+        if (convert_table[i].sse2 && __builtin_cpu_supports("sse2")) {
+            trace("PipeWire: converting %s (sse2)\n", convert_table[i].name);
+            return convert_table[i].sse2;
         }
 #endif
+        trace("PipeWire: converting %s\n", convert_table[i].name);
+        return convert_table[i].c;
+    }
+    return NULL;
+}
 
-        int len = nframes * _stride;
-        int bytesread=0;
-        if (deadbeef->streamer_ok_to_read(-1)) {
-            bytesread = deadbeef->streamer_read (buf->datas[0].data , len);
-        }
-        // if (bytesread != 0) {
-        //     b->size = bytesread / _stride;
-        // }
-        if (bytesread < len) {
-            spa_memzero(buf->datas[0].data+bytesread, len-bytesread);
+static void deinterleave_f32_c(float *const *dst, uint32_t offset, const float *src, uint32_t channels, uint32_t n_frames) {
+    for (uint32_t c = 0; c < channels; c++) {
+        float *d = dst[c] + offset;
+        const float *s = src + c;
+        for (uint32_t i = 0; i < n_frames; i++, s += channels) {
+            d[i] = *s;
         }
+    }
+}
 
-        buf->datas[0].chunk->offset = 0;
-        buf->datas[0].chunk->stride = _stride;
-        buf->datas[0].chunk->size = bytesread;
+// Scalar leftovers of the SIMD kernels, channels [c0, c1) and frames [first_frame, n_frames)
+static void deinterleave_f32_tail(float *const *dst, uint32_t offset, const float *src, uint32_t channels,
+        uint32_t c0, uint32_t c1, uint32_t first_frame, uint32_t n_frames) {
+    for (uint32_t c = c0; c < c1; c++) {
+        float *d = dst[c] + offset;
+        for (uint32_t i = first_frame; i < n_frames; i++) {
+            d[i] = src[i * channels + c];
+        }
+    }
+}
 
-        trace("%d len: %d stride: %d requested: %ld nframes: %d maxsize: %u (/ stride %d) _buffersize %d bytesread %d\n",
-            counter++, len, _stride, b->requested, nframes, buf->datas[0].maxsize, buf->datas[0].maxsize / _stride, buffersize, bytesread);
+#ifdef DDBPW_HAVE_X86_SIMD
+/* Transposes 4x4 blocks: four frames of four channels in, four runs of four
+ * samples out. Stereo gets its own shuffle since it has no full block. */
+__attribute__((target("sse2")))
+static void deinterleave_f32_sse2(float *const *dst, uint32_t offset, const float *src, uint32_t channels, uint32_t n_frames) {
+    uint32_t blocks = n_frames & ~3u;
+    uint32_t c = 0;
+
+    if (channels == 2) {
+        float *l = dst[0] + offset, *r = dst[1] + offset;
+        for (uint32_t i = 0; i < blocks; i += 4) {
+            __m128 a = _mm_loadu_ps(src + 2 * i);
+            __m128 b = _mm_loadu_ps(src + 2 * i + 4);
+            _mm_storeu_ps(l + i, _mm_shuffle_ps(a, b, _MM_SHUFFLE(2, 0, 2, 0)));
+            _mm_storeu_ps(r + i, _mm_shuffle_ps(a, b, _MM_SHUFFLE(3, 1, 3, 1)));
+        }
+        deinterleave_f32_tail(dst, offset, src, 2, 0, 2, blocks, n_frames);
+        return;
+    }
 
-        pw_stream_queue_buffer(data->stream, b);
+    for (; c + 4 <= channels; c += 4) {
+        float *d0 = dst[c] + offset, *d1 = dst[c+1] + offset, *d2 = dst[c+2] + offset, *d3 = dst[c+3] + offset;
+        const float *s = src + c;
+        for (uint32_t i = 0; i < blocks; i += 4, s += 4 * channels) {
+            __m128 r0 = _mm_loadu_ps(s);
+            __m128 r1 = _mm_loadu_ps(s + channels);
+            __m128 r2 = _mm_loadu_ps(s + 2 * channels);
+            __m128 r3 = _mm_loadu_ps(s + 3 * channels);
+            _MM_TRANSPOSE4_PS(r0, r1, r2, r3);
+            _mm_storeu_ps(d0 + i, r0);
+            _mm_storeu_ps(d1 + i, r1);
+            _mm_storeu_ps(d2 + i, r2);
+            _mm_storeu_ps(d3 + i, r3);
+        }
     }
+    deinterleave_f32_tail(dst, offset, src, channels, 0, c, blocks, n_frames);
+    deinterleave_f32_tail(dst, offset, src, channels, c, channels, 0, n_frames);
 }
 
-static void
-set_volume(int dolock, float volume) {
-    if (data.stream && state != DDB_PLAYBACK_STATE_STOPPED) {
-        float vol[SPA_AUDIO_MAX_CHANNELS] = {0};
+// Same with 8x8 blocks, which covers 7.1 and the common larger layouts in one pass per block
+__attribute__((target("avx")))
+static void deinterleave_f32_avx(float *const *dst, uint32_t offset, const float *src, uint32_t channels, uint32_t n_frames) {
+    uint32_t blocks = n_frames & ~7u;
+    uint32_t c = 0;
 
-        for (int i = 0; i < plugin.fmt.channels; i++) {
-            vol[i] = volume;
-        }
+    if (channels < 8) {
+        deinterleave_f32_sse2(dst, offset, src, channels, n_frames);
+        return;
+    }
 
-        if (dolock) {
-            pw_thread_loop_lock(data.loop);
-        }
-        pw_stream_set_control(data.stream, SPA_PROP_channelVolumes, plugin.fmt.channels, vol, 0);
-        if (dolock) {
-            pw_thread_loop_unlock(data.loop);
+    for (; c + 8 <= channels; c += 8) {
+        const float *s = src + c;
+        for (uint32_t i = 0; i < blocks; i += 8, s += 8 * channels) {
+            __m256 r[8], t[8], u[8];
+            for (int k = 0; k < 8; k++) {
+                r[k] = _mm256_loadu_ps(s + k * channels);
+            }
+            for (int k = 0; k < 8; k += 2) {
+                t[k] = _mm256_unpacklo_ps(r[k], r[k+1]);
+                t[k+1] = _mm256_unpackhi_ps(r[k], r[k+1]);
+            }
+            for (int k = 0; k < 8; k += 4) {
+                u[k] = _mm256_shuffle_ps(t[k], t[k+2], _MM_SHUFFLE(1, 0, 1, 0));
+                u[k+1] = _mm256_shuffle_ps(t[k], t[k+2], _MM_SHUFFLE(3, 2, 3, 2));
+                u[k+2] = _mm256_shuffle_ps(t[k+1], t[k+3], _MM_SHUFFLE(1, 0, 1, 0));
+                u[k+3] = _mm256_shuffle_ps(t[k+1], t[k+3], _MM_SHUFFLE(3, 2, 3, 2));
+            }
+            for (int k = 0; k < 4; k++) {
+                _mm256_storeu_ps(dst[c+k] + offset + i, _mm256_permute2f128_ps(u[k], u[k+4], 0x20));
+                _mm256_storeu_ps(dst[c+k+4] + offset + i, _mm256_permute2f128_ps(u[k], u[k+4], 0x31));
+            }
         }
     }
+    deinterleave_f32_tail(dst, offset, src, channels, 0, c, blocks, n_frames);
+    // Leftover channels of an odd layout, e.g. the last two of 10
+    deinterleave_f32_tail(dst, offset, src, channels, c, channels, 0, n_frames);
 }
+#endif
 
-static void on_state_changed(void *_data, enum pw_stream_state old,
-        enum pw_stream_state pwstate, const char *error) {
-    trace("PipeWire: Stream state %s\n", pw_stream_state_as_string(pwstate));
+static deinterleave_func_t select_deinterleave(void) {
+#ifdef DDBPW_HAVE_X86_SIMD
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx")) {
+        trace("PipeWire: deinterleaving to planar f32 (avx)\n");
+        return deinterleave_f32_avx;
+    }
+    if (__builtin_cpu_supports("sse2")) {
+        trace("PipeWire: deinterleaving to planar f32 (sse2)\n");
+        return deinterleave_f32_sse2;
+    }
+#endif
+    trace("PipeWire: deinterleaving to planar f32\n");
+    return deinterleave_f32_c;
+}
+
+static void meter_f32_c(const float *src, uint32_t channels, uint32_t n_frames, float *peak, double *sumsq) {
+    for (uint32_t c = 0; c < channels; c++) {
+        const float *s = src + c;
+        float p = peak[c];
+        float sq = 0;
+        for (uint32_t i = 0; i < n_frames; i++, s += channels) {
+            float v = fabsf(*s);
+            p = v > p ? v : p;
+            sq += v * v;
+        }
+        peak[c] = p;
+        sumsq[c] += sq;
+    }
+}
 
-    if (_setformat_requested) {
+#ifdef DDBPW_HAVE_X86_SIMD
+/* A block of lcm(4, channels) samples puts the same channel in the same
+ * lane every time, so peaks and sums stay in vector registers for the whole
+ * buffer and are folded per channel at the end. Up to 8 channels, more go
+ * through the C version. */
+__attribute__((target("sse2")))
+static void meter_f32_sse2(const float *src, uint32_t channels, uint32_t n_frames, float *peak, double *sumsq) {
+    if (channels > 8) {
+        meter_f32_c(src, channels, n_frames, peak, sumsq);
         return;
     }
 
-    if (pwstate == PW_STREAM_STATE_ERROR || (state == DDB_PLAYBACK_STATE_PLAYING && pwstate == PW_STREAM_STATE_UNCONNECTED ) ) {
-        log_err("PipeWire: Stream error: %s\n", error);
-        deadbeef->sendmessage(DB_EV_STOP, 0, 0, 0);
+    uint32_t g = channels % 4 == 0 ? 4 : channels % 2 == 0 ? 2 : 1;
+    uint32_t vecs = channels / g;
+    uint32_t block = 4 / g;
+    uint32_t blocks = n_frames / block;
+    const __m128 abs_mask = _mm_castsi128_ps(_mm_set1_epi32(0x7fffffff));
+    __m128 pk[8], sq[8];
+    const float *s = src;
+
+    for (uint32_t k = 0; k < vecs; k++) {
+        pk[k] = _mm_setzero_ps();
+        sq[k] = _mm_setzero_ps();
+    }
+    for (uint32_t i = 0; i < blocks; i++, s += 4 * vecs) {
+        for (uint32_t k = 0; k < vecs; k++) {
+            __m128 v = _mm_and_ps(_mm_loadu_ps(s + 4 * k), abs_mask);
+            pk[k] = _mm_max_ps(pk[k], v);
+            sq[k] = _mm_add_ps(sq[k], _mm_mul_ps(v, v));
+        }
     }
-}
 
-static void on_control_info(void *_data, uint32_t id, const struct pw_stream_control *control) {
-#ifdef DDBPW_DEBUG
+    float lane_pk[32], lane_sq[32];
+    for (uint32_t k = 0; k < vecs; k++) {
+        _mm_storeu_ps(lane_pk + 4 * k, pk[k]);
+        _mm_storeu_ps(lane_sq + 4 * k, sq[k]);
+    }
+    for (uint32_t j = 0; j < 4 * vecs; j++) {
+        uint32_t c = j % channels;
+        peak[c] = SPA_MAX(peak[c], lane_pk[j]);
+        sumsq[c] += lane_sq[j];
+    }
+    meter_f32_c(s, channels, n_frames - blocks * block, peak, sumsq);
+}
+#endif
 
-    fprintf(stderr, "PipeWire: Control %s", control->name);
-    for (int i = 0; i < control->n_values; i++) {
-        fprintf(stderr, " value[%d] = %f", i, control->values[i]);
+static meter_func_t select_meter(void) {
+#ifdef DDBPW_HAVE_X86_SIMD
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("sse2")) {
+        return meter_f32_sse2;
     }
-    fprintf(stderr, "\n");
 #endif
+    return meter_f32_c;
+}
 
-    if (id == SPA_PROP_channelVolumes && plugin.has_volume) {
-        float dbvol = deadbeef->volume_get_amp();
-        int changedvolume = 0;
-        for (int i = 0; i < control->n_values; i++) {
-            if (control->values[i] != dbvol) {
-                changedvolume = i;
+// Integer output with a meter attached is the rare case, it goes sample by sample
+static void meter_int_c(const uint8_t *src, uint32_t format, uint32_t channels, uint32_t n_frames, float *peak, double *sumsq) {
+    uint32_t bytes = format == SPA_AUDIO_FORMAT_S8 ? 1 : format == SPA_AUDIO_FORMAT_S16_LE ? 2 : format == SPA_AUDIO_FORMAT_S24_LE ? 3 : 4;
+
+    for (uint32_t i = 0; i < n_frames; i++) {
+        for (uint32_t c = 0; c < channels; c++, src += bytes) {
+            float v;
+            switch (format) {
+            case SPA_AUDIO_FORMAT_S8:
+                v = *(const int8_t *)src / 128.0f;
+                break;
+            case SPA_AUDIO_FORMAT_S16_LE:
+                v = *(const int16_t *)src / 32768.0f;
+                break;
+            case SPA_AUDIO_FORMAT_S24_LE:
+                v = s24_to_s32(src) / 2147483648.0f;
+                break;
+            case SPA_AUDIO_FORMAT_S24_32_LE:
+                v = *(const int32_t *)src / 8388608.0f;
+                break;
+            default:
+                v = *(const int32_t *)src / 2147483648.0f;
                 break;
             }
+            v = fabsf(v);
+            peak[c] = SPA_MAX(peak[c], v);
+            sumsq[c] += v * v;
         }
+    }
+}
 
-        deadbeef->volume_set_amp(control->values[changedvolume]);
+// Consumer side. Like ring_read but runs conv over whole samples on the way out.
+static uint32_t ring_read_convert(struct ring *r, uint32_t *readindex, void *dst, uint32_t len, uint32_t in_bytes, uint32_t out_bytes, convert_func_t conv) {
+    uint32_t rd = __atomic_load_n(readindex, __ATOMIC_RELAXED);
+    uint32_t w = __atomic_load_n(&r->writeindex, __ATOMIC_ACQUIRE);
+    len = SPA_MIN(len, w - rd);
+    len -= len % in_bytes;
+
+    uint32_t offset = rd & r->mask;
+    uint32_t l0 = SPA_MIN(len, r->size - offset);
+    uint32_t l1 = len - l0;
+    uint32_t n0 = l0 / in_bytes;
+    const uint8_t *src1 = r->buffer;
+    uint8_t *d = dst;
+
+    conv(d, r->buffer + offset, n0);
+    d += n0 * out_bytes;
+
+    // A sample straddling the end of the ring goes through a small bounce buffer
+    uint32_t split = l0 - n0 * in_bytes;
+    if (split) {
+        uint8_t tmp[4];
+        memcpy(tmp, r->buffer + offset + n0 * in_bytes, split);
+        memcpy(tmp + split, r->buffer, in_bytes - split);
+        conv(d, tmp, 1);
+        d += out_bytes;
+        src1 += in_bytes - split;
+        l1 -= in_bytes - split;
     }
+    conv(d, src1, l1 / in_bytes);
+
+    __atomic_store_n(readindex, rd + len, __ATOMIC_RELEASE);
+    return len;
 }
 
-static void on_param_changed(void *userdata, uint32_t id, const struct spa_pod *param) {
-    if (id != SPA_PARAM_Format || param == NULL) {
-        return;
+// Consumer side. Copies up to nframes in output format, returns the number of frames.
+static uint32_t ring_read_frames(struct ring *r, uint32_t *readindex, void *dst, uint32_t nframes) {
+    uint32_t len = nframes * _stride;
+    uint32_t fill = ring_fill(r, readindex);
+    fill -= fill % _stride;
+    len = SPA_MIN(len, fill);
+
+    if (_convert) {
+        len = ring_read_convert(r, readindex, dst, len, plugin.fmt.bps / 8, _out_stride / plugin.fmt.channels, _convert);
+    } else {
+        len = ring_read(r, readindex, dst, len);
     }
+    return len / _stride;
+}
 
-    if (plugin.has_volume) {
-        set_volume(0, _initialvol);
+/* Consumer side. Deinterleaves up to nframes into one float plane per channel,
+ * converting through a small scratch buffer first when the input is not
+ * float. Returns the number of frames. */
+static uint32_t ring_read_planar(struct ring *r, uint32_t *readindex, float *const *planes, uint32_t nframes) {
+    uint32_t channels = plugin.fmt.channels;
+    uint32_t rd = __atomic_load_n(readindex, __ATOMIC_RELAXED);
+    uint32_t w = __atomic_load_n(&r->writeindex, __ATOMIC_ACQUIRE);
+    uint32_t chunk = DDBPW_PLANAR_CHUNK / channels;
+    float tmp[DDBPW_PLANAR_CHUNK];
+    float bounce[SPA_AUDIO_MAX_CHANNELS];
+
+    nframes = SPA_MIN(nframes, (w - rd) / _stride);
+
+    for (uint32_t done = 0, n; done < nframes; done += n) {
+        uint32_t offset = (rd + done * _stride) & r->mask;
+        const void *src = r->buffer + offset;
+
+        n = SPA_MIN(nframes - done, chunk);
+        n = SPA_MIN(n, (r->size - offset) / _stride);
+        // A frame straddling the end of the ring goes through a bounce buffer
+        if (n == 0) {
+            uint32_t l0 = r->size - offset;
+            memcpy(bounce, src, l0);
+            memcpy((uint8_t *)bounce + l0, r->buffer, _stride - l0);
+            src = bounce;
+            n = 1;
+        }
+        if (_convert) {
+            _convert(tmp, src, n * channels);
+            src = tmp;
+        }
+        _deinterleave(planes, done, src, channels, n);
     }
 
-#ifdef ENABLE_BUFFER_OPTION
-    {
-        const struct spa_pod *params[1];
-        uint8_t buffer[4096];
-        struct spa_pod_builder b = SPA_POD_BUILDER_INIT(buffer, sizeof(buffer));
-        int stride = plugin.fmt.channels * (plugin.fmt.bps/8);
-        int size = _buffersize*stride;
+    __atomic_store_n(readindex, rd + nframes * _stride, __ATOMIC_RELEASE);
+    return nframes;
+}
+
+// Frames that fit in every data of buf, 0 when it is not mapped the way we negotiated
+static uint32_t buffer_frames(struct spa_buffer *buf) {
+    if (!_planar) {
+        return buf->datas[0].data ? buf->datas[0].maxsize / _out_stride : 0;
+    }
+    if (buf->n_datas < (uint32_t)plugin.fmt.channels) {
+        return 0;
+    }
+    uint32_t frames = UINT32_MAX;
+    for (int c = 0; c < plugin.fmt.channels; c++) {
+        if (!buf->datas[c].data) {
+            return 0;
+        }
+        frames = SPA_MIN(frames, buf->datas[c].maxsize / (uint32_t)sizeof(float));
+    }
+    return frames;
+}
 
-        params[0] = spa_pod_builder_add_object(&b,
-                SPA_TYPE_OBJECT_ParamBuffers, SPA_PARAM_Buffers,
-                SPA_PARAM_BUFFERS_blocks,  SPA_POD_Int(1),
-                SPA_PARAM_BUFFERS_size,    SPA_POD_Int(size),
-                SPA_PARAM_BUFFERS_stride,  SPA_POD_Int(stride));
+/* Consumer side. Fills nframes of buf from the ring, or only silence when
+ * silent is set, and pads whatever the ring could not supply with zeros.
+ * Returns the number of frames taken from the ring. */
+static uint32_t fill_buffer(struct ring *r, uint32_t *readindex, struct spa_buffer *buf, uint32_t nframes, int silent) {
+    uint32_t got = 0;
 
-        pw_stream_update_params(data.stream, params, 1);
+    if (!_planar) {
+        if (!silent) {
+            got = ring_read_frames(r, readindex, buf->datas[0].data, nframes);
+        }
+        if (got < nframes) {
+            spa_memzero((uint8_t *)buf->datas[0].data + got * _out_stride, (nframes - got) * _out_stride);
+        }
+        buf->datas[0].chunk->offset = 0;
+        buf->datas[0].chunk->stride = _out_stride;
+        buf->datas[0].chunk->size = got * _out_stride;
+        return got;
     }
-#endif
 
+    float *planes[SPA_AUDIO_MAX_CHANNELS];
+    for (int c = 0; c < plugin.fmt.channels; c++) {
+        planes[c] = buf->datas[c].data;
+    }
+    if (!silent) {
+        got = ring_read_planar(r, readindex, planes, nframes);
+    }
+    for (int c = 0; c < plugin.fmt.channels; c++) {
+        if (got < nframes) {
+            spa_memzero(planes[c] + got, (nframes - got) * sizeof(float));
+        }
+        buf->datas[c].chunk->offset = 0;
+        buf->datas[c].chunk->stride = sizeof(float);
+        buf->datas[c].chunk->size = got * sizeof(float);
+    }
+    return got;
 }
 
-static const struct pw_stream_events stream_events = {
-    PW_VERSION_STREAM_EVENTS,
-    .process = on_process,
-    .state_changed = on_state_changed,
-    .control_info = on_control_info,
-    .param_changed = on_param_changed,
-};
+// Consumer side. A buffer we cannot fill still goes back empty, or the stream runs out of them.
+static void queue_empty_buffer(struct pw_stream *stream, struct pw_buffer *b) {
+    struct spa_buffer *buf = b->buffer;
 
-static void do_update_media_props(DB_playItem_t *track, struct pw_properties *props) {
-    int rc = 0, notrackgiven=0;
+    for (uint32_t i = 0; i < buf->n_datas; i++) {
+        if (buf->datas[i].chunk) {
+            buf->datas[i].chunk->offset = 0;
+            buf->datas[i].chunk->size = 0;
+        }
+    }
+    pw_stream_queue_buffer(stream, b);
+}
 
-    ddb_tf_context_t ctx = {
-        ._size = sizeof(ddb_tf_context_t),
-        .flags = DDB_TF_CONTEXT_NO_DYNAMIC,
-        .plt = NULL,
-        .iter = PL_MAIN
-    };
+static void my_pw_init(void) {
+    if (data.pw_has_init || __atomic_load_n(&state, __ATOMIC_ACQUIRE) != DDB_PLAYBACK_STATE_STOPPED) {
+        return;
+    }
+    pw_init(NULL, NULL);
+    data.pw_has_init = 1;
+}
 
-    if (!track) {
-        track = deadbeef->streamer_get_playing_track_safe();
-        if (track == NULL) {
-            return;
+static void my_pw_deinit(void) {
+    if (!data.pw_has_init || __atomic_load_n(&state, __ATOMIC_ACQUIRE) != DDB_PLAYBACK_STATE_STOPPED || sink_cache.loop) {
+        return;
+    }
+    pw_deinit();
+    data.pw_has_init = 0;
+}
+
+static int64_t get_monotonic_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * SPA_NSEC_PER_SEC + ts.tv_nsec;
+}
+
+/* Binary trace rings, one per role in ddbpw_trace.h. The RT and feeder
+ * rings have a single writer thread, the loop ring is only written with
+ * the loop lock held, and the caller ring takes its slots atomically.
+ * Recording an event is a clock read and a handful of stores, the file
+ * is written by trace_flush from the loop or on request.
+ * A claimed slot is only complete once its seq reads position + 1, the
+ * caller ring can have slots past one still being written. */
+struct trace_ring {
+    uint32_t head SPA_ALIGNED(DDBPW_CACHELINE);
+    uint32_t flushed SPA_ALIGNED(DDBPW_CACHELINE);
+    ddbpw_trace_event events[DDBPW_TRACE_EVENTS];
+    uint32_t seq[DDBPW_TRACE_EVENTS];
+};
+
+// Allocated the first time tracing is switched on and kept until the plugin stops
+static struct trace_ring *trace_rings;
+static int trace_enabled;
+static FILE *trace_file;
+static uintptr_t trace_mutex;
+
+static inline void trace_event(int role, uint16_t type, uint32_t a, uint32_t b, uint32_t c) {
+    if (!__atomic_load_n(&trace_enabled, __ATOMIC_ACQUIRE)) {
+        return;
+    }
+    struct trace_ring *r = &trace_rings[role];
+    uint32_t i = role == DDBPW_TRACE_CALLER ? __atomic_fetch_add(&r->head, 1, __ATOMIC_RELAXED) : r->head;
+    ddbpw_trace_event *e = &r->events[i & (DDBPW_TRACE_EVENTS - 1)];
+
+    e->ts = get_monotonic_ns();
+    e->type = type;
+    e->role = role;
+    e->a = a;
+    e->b = b;
+    e->c = c;
+    __atomic_store_n(&r->seq[i & (DDBPW_TRACE_EVENTS - 1)], i + 1, __ATOMIC_RELEASE);
+    if (role != DDBPW_TRACE_CALLER) {
+        __atomic_store_n(&r->head, i + 1, __ATOMIC_RELEASE);
+    }
+}
+
+// Loop or caller thread. Turns tracing on or off as configured, the rings are pre-faulted here.
+static void trace_setup(void) {
+    if (!deadbeef->conf_get_int(CONFSTR_DDBPW_TRACE, DDBPW_DEFAULT_TRACE)) {
+        __atomic_store_n(&trace_enabled, 0, __ATOMIC_RELEASE);
+        return;
+    }
+    if (!trace_rings) {
+        trace_rings = malloc(DDBPW_TRACE_ROLES * sizeof(struct trace_ring));
+        if (!trace_rings) {
+            log_err("PipeWire: could not allocate trace buffers\n");
+            return;
+        }
+        memset(trace_rings, 0, DDBPW_TRACE_ROLES * sizeof(struct trace_ring));
+    }
+    __atomic_store_n(&trace_enabled, 1, __ATOMIC_RELEASE);
+}
+
+// Any thread but RT. Appends what the rings gained since the last flush to the trace file.
+static int trace_flush(void) {
+    if (!trace_rings) {
+        return -1;
+    }
+    deadbeef->mutex_lock(trace_mutex);
+    if (!trace_file) {
+        char path[PATH_MAX];
+        deadbeef->conf_get_str(CONFSTR_DDBPW_TRACEFILE, DDBPW_DEFAULT_TRACEFILE, path, sizeof(path));
+        if (!(trace_file = fopen(path, "wb"))) {
+            log_err("PipeWire: could not open trace file %s: %s\n", path, strerror(errno));
+            __atomic_store_n(&trace_enabled, 0, __ATOMIC_RELEASE);
+            deadbeef->mutex_unlock(trace_mutex);
+            return -1;
+        }
+        ddbpw_trace_header h = { .version = DDBPW_TRACE_VERSION, .event_size = sizeof(ddbpw_trace_event) };
+        memcpy(h.magic, DDBPW_TRACE_MAGIC, sizeof(h.magic));
+        fwrite(&h, sizeof(h), 1, trace_file);
+    }
+
+    for (int role = 0; role < DDBPW_TRACE_ROLES; role++) {
+        struct trace_ring *r = &trace_rings[role];
+        uint32_t head = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE);
+        uint32_t from = r->flushed;
+
+        // Lapped since the last flush, say how much is missing and keep what is still there
+        if (head - from > DDBPW_TRACE_EVENTS) {
+            from = head - DDBPW_TRACE_EVENTS;
+            ddbpw_trace_event lost = {
+                .ts = r->events[from & (DDBPW_TRACE_EVENTS - 1)].ts,
+                .type = DDBPW_EV_OVERRUN,
+                .role = role,
+                .a = from - r->flushed,
+            };
+            fwrite(&lost, sizeof(lost), 1, trace_file);
+        }
+
+        // Stop at the first slot still being written, the next flush picks up from there
+        uint32_t end = from;
+        while (end != head && __atomic_load_n(&r->seq[end & (DDBPW_TRACE_EVENTS - 1)], __ATOMIC_ACQUIRE) == end + 1) {
+            end++;
+        }
+
+        uint32_t offset = from & (DDBPW_TRACE_EVENTS - 1);
+        uint32_t n = end - from;
+        uint32_t n0 = SPA_MIN(n, DDBPW_TRACE_EVENTS - offset);
+        fwrite(&r->events[offset], sizeof(ddbpw_trace_event), n0, trace_file);
+        fwrite(&r->events[0], sizeof(ddbpw_trace_event), n - n0, trace_file);
+        r->flushed = end;
+    }
+    fflush(trace_file);
+    deadbeef->mutex_unlock(trace_mutex);
+    return 0;
+}
+
+static void on_trace_timer(void *userdata, uint64_t expirations) {
+    trace_flush();
+}
+
+static inline uint64_t read_cycles(void) {
+#ifdef DDBPW_HAVE_X86_SIMD
+    return __rdtsc();
+#else
+    return 0;
+#endif
+}
+
+static int stats_bucket(uint32_t frames) {
+    // <64, 64+, 128+, ... 4096+
+    if (frames < 64) {
+        return 0;
+    }
+    return SPA_MIN(31 - __builtin_clz(frames) - 5, DDBPW_STATS_BUCKETS - 1);
+}
+
+static int cost_bucket(uint64_t ns) {
+    if (ns < 256) {
+        return 0;
+    }
+    return SPA_MIN(63 - __builtin_clzll(ns) - 7, DDBPW_COST_BUCKETS - 1);
+}
+
+// RT side. Hands work to the loop thread without taking any lock.
+static void notify_loop(struct data *data, int bits) {
+    __atomic_fetch_or(&data->notify, bits, __ATOMIC_RELEASE);
+    pw_loop_signal_event(pw_thread_loop_get_loop(data->loop), data->notify_event);
+}
+
+// RT side. Everything between streamer_read and the speaker, in ns.
+static void latency_update(struct data *data, const struct pw_time *time, int64_t now) {
+    ddb_pw_latency_t *l = &data->out_latency;
+    uint32_t rate = plugin.fmt.samplerate;
+    int64_t graph = time->rate.denom ? time->delay * SPA_NSEC_PER_SEC * time->rate.num / time->rate.denom : 0;
+    int64_t stream = rate ? (int64_t)(time->queued + time->buffered) * SPA_NSEC_PER_SEC / rate : 0;
+    int64_t ring = rate && _stride ? (int64_t)(ring_fill(&data->ring, &data->ring.readindex) / _stride) * SPA_NSEC_PER_SEC / rate : 0;
+    int64_t sample = graph + stream + ring;
+    int64_t total = l->total ? l->total + (sample - l->total) / DDBPW_LATENCY_SMOOTH : sample;
+
+    __atomic_store_n(&data->out_latency_seq, data->out_latency_seq + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    // Relaxed atomics, a reader may copy them halfway through and retries
+    __atomic_store_n(&l->total, total, __ATOMIC_RELAXED);
+    __atomic_store_n(&l->graph, graph, __ATOMIC_RELAXED);
+    __atomic_store_n(&l->stream, stream, __ATOMIC_RELAXED);
+    __atomic_store_n(&l->ring, ring, __ATOMIC_RELAXED);
+    __atomic_store_n(&l->updated, now, __ATOMIC_RELAXED);
+    __atomic_store_n(&data->out_latency_seq, data->out_latency_seq + 1, __ATOMIC_RELEASE);
+
+    if (total - data->out_latency_reported > DDBPW_LATENCY_REPORT_NS || data->out_latency_reported - total > DDBPW_LATENCY_REPORT_NS) {
+        data->out_latency_reported = total;
+        notify_loop(data, DDBPW_NOTIFY_LATENCY);
+    }
+}
+
+// Any thread. Retries while the RT thread is halfway through an update.
+static void latency_read(struct data *data, ddb_pw_latency_t *out) {
+    uint32_t seq;
+
+    do {
+        while ((seq = __atomic_load_n(&data->out_latency_seq, __ATOMIC_ACQUIRE)) & 1) {
+        }
+        out->total = __atomic_load_n(&data->out_latency.total, __ATOMIC_RELAXED);
+        out->graph = __atomic_load_n(&data->out_latency.graph, __ATOMIC_RELAXED);
+        out->stream = __atomic_load_n(&data->out_latency.stream, __ATOMIC_RELAXED);
+        out->ring = __atomic_load_n(&data->out_latency.ring, __ATOMIC_RELAXED);
+        out->updated = __atomic_load_n(&data->out_latency.updated, __ATOMIC_RELAXED);
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    } while (seq != __atomic_load_n(&data->out_latency_seq, __ATOMIC_RELAXED));
+}
+
+// RT side. Adds what this quantum wrote to the window and publishes it once the window is full.
+static void meter_update(struct data *data, struct spa_buffer *buf, uint32_t nframes, int64_t now) {
+    ddb_pw_meter_t *m = &data->meter;
+    uint32_t channels = plugin.fmt.channels;
+    uint32_t format = data->offered.format;
+
+    if (!data->meter_running) {
+        data->meter_running = 1;
+        memset(data->meter_peak, 0, sizeof(data->meter_peak));
+        memset(data->meter_sumsq, 0, sizeof(data->meter_sumsq));
+        data->meter_frames = 0;
+    }
+
+    if (_planar) {
+        for (uint32_t c = 0; c < channels; c++) {
+            _meter_f32(buf->datas[c].data, 1, nframes, &data->meter_peak[c], &data->meter_sumsq[c]);
+        }
+    } else if (format == SPA_AUDIO_FORMAT_F32_LE) {
+        _meter_f32(buf->datas[0].data, channels, nframes, data->meter_peak, data->meter_sumsq);
+    } else {
+        meter_int_c(buf->datas[0].data, format, channels, nframes, data->meter_peak, data->meter_sumsq);
+    }
+    data->meter_frames += nframes;
+
+    if ((uint64_t)data->meter_frames * 1000 < (uint64_t)plugin.fmt.samplerate * DDBPW_METER_WINDOW_MS) {
+        return;
+    }
+
+    __atomic_store_n(&data->meter_seq, data->meter_seq + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    // Relaxed atomics, a reader may copy them halfway through and retries
+    __atomic_store_n(&m->channels, channels, __ATOMIC_RELAXED);
+    __atomic_store_n(&m->frames, data->meter_frames, __ATOMIC_RELAXED);
+    __atomic_store_n(&m->updated, now, __ATOMIC_RELAXED);
+    for (uint32_t c = 0; c < channels; c++) {
+        float rms = sqrtf(data->meter_sumsq[c] / data->meter_frames);
+        __atomic_store(&m->peak[c], &data->meter_peak[c], __ATOMIC_RELAXED);
+        __atomic_store(&m->rms[c], &rms, __ATOMIC_RELAXED);
+    }
+    __atomic_store_n(&data->meter_seq, data->meter_seq + 1, __ATOMIC_RELEASE);
+
+    memset(data->meter_peak, 0, sizeof(data->meter_peak));
+    memset(data->meter_sumsq, 0, sizeof(data->meter_sumsq));
+    data->meter_frames = 0;
+
+    if (data->meter_props && now - data->meter_props_sent >= DDBPW_METER_PROPS_NS) {
+        data->meter_props_sent = now;
+        notify_loop(data, DDBPW_NOTIFY_METER);
+    }
+}
+
+// Any thread. Retries while the RT thread is halfway through an update.
+static void meter_read(struct data *data, ddb_pw_meter_t *out) {
+    uint32_t seq;
+
+    do {
+        while ((seq = __atomic_load_n(&data->meter_seq, __ATOMIC_ACQUIRE)) & 1) {
+        }
+        out->channels = __atomic_load_n(&data->meter.channels, __ATOMIC_RELAXED);
+        out->frames = __atomic_load_n(&data->meter.frames, __ATOMIC_RELAXED);
+        out->updated = __atomic_load_n(&data->meter.updated, __ATOMIC_RELAXED);
+        for (int c = 0; c < DDB_PW_METER_CHANNELS; c++) {
+            __atomic_load(&data->meter.peak[c], &out->peak[c], __ATOMIC_RELAXED);
+            __atomic_load(&data->meter.rms[c], &out->rms[c], __ATOMIC_RELAXED);
+        }
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    } while (seq != __atomic_load_n(&data->meter_seq, __ATOMIC_RELAXED));
+}
+
+// Loop thread. dB values with one decimal, comma separated, silence as -inf
+static void format_levels(char *out, size_t size, const float *levels, uint32_t channels) {
+    size_t pos = 0;
+    out[0] = 0;
+    for (uint32_t c = 0; c < channels && pos < size; c++) {
+        float db = levels[c] > 0 ? 20.0f * log10f(levels[c]) : -INFINITY;
+        pos += snprintf(out + pos, size - pos, "%s%.1f", c ? "," : "", db);
+    }
+}
+
+// Called from on_process, must not allocate or block
+static void stats_update(struct data *data, int64_t now, uint32_t requested, uint32_t delivered, int underrun) {
+    struct stats *st = &data->stats;
+    struct pw_time time;
+
+    if (st->last_callback && plugin.fmt.samplerate) {
+        int64_t expected = (int64_t)requested * SPA_NSEC_PER_SEC / plugin.fmt.samplerate;
+        int64_t interval = now - st->last_callback;
+        uint64_t jitter = interval > expected ? interval - expected : expected - interval;
+        STAT_ADD(st->jitter_sum, jitter);
+        if (jitter > STAT_GET(st->jitter_max)) {
+            STAT_SET(st->jitter_max, jitter);
+        }
+    }
+    st->last_callback = now;
+
+    STAT_ADD(st->callbacks, 1);
+    STAT_ADD(st->frames_requested, requested);
+    STAT_ADD(st->frames_delivered, delivered);
+    STAT_ADD(st->requested_hist[stats_bucket(requested)], 1);
+    STAT_ADD(st->delivered_hist[stats_bucket(delivered)], 1);
+    if (underrun) {
+        STAT_ADD(st->underruns, 1);
+    }
+
+    if (pw_stream_get_time_n(data->stream, &time, sizeof(time)) == 0) {
+        STAT_SET(st->delay, time.delay);
+        STAT_SET(st->queued, time.queued);
+        STAT_SET(st->buffered, time.buffered);
+        STAT_SET(st->graph_rate, time.rate.denom);
+        latency_update(data, &time, now);
+    }
+}
+
+// Called at the very end of on_process with the time and cycles it started at
+static void stats_cost(struct data *data, int64_t start, uint64_t start_cycles, uint32_t frames) {
+    struct stats *st = &data->stats;
+    uint64_t ns = get_monotonic_ns() - start;
+
+    STAT_ADD(st->cost_ns, ns);
+    STAT_ADD(st->cost_cycles, read_cycles() - start_cycles);
+    STAT_ADD(st->cost_frames, frames);
+    STAT_ADD(st->cost_hist[cost_bucket(ns)], 1);
+    if (ns > STAT_GET(st->cost_max)) {
+        STAT_SET(st->cost_max, ns);
+    }
+}
+
+// Upper bound of the bucket holding the given fraction of callbacks
+static uint64_t cost_percentile(const uint64_t *cur, const uint64_t *prev, uint64_t total, double fraction) {
+    uint64_t sum = 0;
+    for (int i = 0; i < DDBPW_COST_BUCKETS; i++) {
+        sum += cur[i] - prev[i];
+        if (sum >= total * fraction) {
+            return 256ull << i;
+        }
+    }
+    return 256ull << (DDBPW_COST_BUCKETS - 1);
+}
+
+static void format_hist(char *out, size_t size, const uint64_t *cur, const uint64_t *prev) {
+    size_t pos = 0;
+    out[0] = 0;
+    for (int i = 0; i < DDBPW_STATS_BUCKETS && pos < size; i++) {
+        pos += snprintf(out + pos, size - pos, "%s%" PRIu64, i ? "," : "", cur[i] - prev[i]);
+    }
+}
+
+// Loop thread. Books the time since the last mark to the current mode, unless playback was held up.
+static void powersave_account(struct data *data, int playing) {
+    int64_t now = get_monotonic_ns();
+    uint64_t callbacks = STAT_GET(data->stats.callbacks);
+
+    if (playing) {
+        data->mode_callbacks[data->powersave_active] += callbacks - data->mode_callbacks_mark;
+        data->mode_ns[data->powersave_active] += now - data->mode_mark;
+    }
+    data->mode_callbacks_mark = callbacks;
+    data->mode_mark = now;
+}
+
+static double powersave_wakeups(struct data *data, int mode) {
+    return data->mode_ns[mode] ? data->mode_callbacks[mode] * 1e9 / data->mode_ns[mode] : 0;
+}
+
+// Runs on the loop thread every CONFSTR_DDBPW_STATSINTERVAL seconds
+static void on_stats_timer(void *userdata, uint64_t expirations) {
+    struct data *data = userdata;
+    struct stats *st = &data->stats;
+    struct stats *prev = &data->stats_prev;
+    struct stats cur;
+
+    cur.callbacks = STAT_GET(st->callbacks);
+    cur.no_buffer = STAT_GET(st->no_buffer);
+    cur.underruns = STAT_GET(st->underruns);
+    cur.frames_requested = STAT_GET(st->frames_requested);
+    cur.frames_delivered = STAT_GET(st->frames_delivered);
+    cur.jitter_sum = STAT_GET(st->jitter_sum);
+    cur.jitter_max = __atomic_exchange_n(&st->jitter_max, 0, __ATOMIC_RELAXED);
+    cur.delay = STAT_GET(st->delay);
+    cur.queued = STAT_GET(st->queued);
+    cur.buffered = STAT_GET(st->buffered);
+    for (int i = 0; i < DDBPW_STATS_BUCKETS; i++) {
+        cur.requested_hist[i] = STAT_GET(st->requested_hist[i]);
+        cur.delivered_hist[i] = STAT_GET(st->delivered_hist[i]);
+    }
+    cur.cost_ns = STAT_GET(st->cost_ns);
+    cur.cost_cycles = STAT_GET(st->cost_cycles);
+    cur.cost_frames = STAT_GET(st->cost_frames);
+    cur.cost_max = __atomic_exchange_n(&st->cost_max, 0, __ATOMIC_RELAXED);
+    for (int i = 0; i < DDBPW_COST_BUCKETS; i++) {
+        cur.cost_hist[i] = STAT_GET(st->cost_hist[i]);
+    }
+    cur.feeder_wakeups = STAT_GET(st->feeder_wakeups);
+    cur.feeder_wake_ns = STAT_GET(st->feeder_wake_ns);
+    cur.feeder_wake_max = __atomic_exchange_n(&st->feeder_wake_max, 0, __ATOMIC_RELAXED);
+    for (int i = 0; i < DDBPW_COST_BUCKETS; i++) {
+        cur.feeder_wake_hist[i] = STAT_GET(st->feeder_wake_hist[i]);
+    }
+
+    uint64_t callbacks = cur.callbacks - prev->callbacks;
+    if (callbacks == 0) {
+        // Nothing holds it back on purpose, yet the graph stopped asking for audio
+        if (__atomic_load_n(&state, __ATOMIC_ACQUIRE) == DDB_PLAYBACK_STATE_PLAYING && !data->prerolling && !_setformat_requested) {
+            log_err("PipeWire: no process callbacks since the last statistics interval while playing, the stream looks stuck\n");
+        }
+        return;
+    }
+
+    uint64_t jitter_avg = (cur.jitter_sum - prev->jitter_sum) / callbacks;
+    char requested[128], delivered[128];
+    format_hist(requested, sizeof(requested), cur.requested_hist, prev->requested_hist);
+    format_hist(delivered, sizeof(delivered), cur.delivered_hist, prev->delivered_hist);
+
+    deadbeef->log_detailed (&plugin.plugin, DDB_LOG_LAYER_INFO,
+        "PipeWire: %" PRIu64 " callbacks, %" PRIu64 " underruns, %" PRIu64 " without buffer, "
+        "jitter avg %" PRIu64 " us max %" PRIu64 " us, frames requested %" PRIu64 " [%s] delivered %" PRIu64 " [%s], "
+        "delay %" PRId64 " queued %" PRIu64 " buffered %" PRIu64 ", ring low-water %u ms\n",
+        callbacks, cur.underruns - prev->underruns, cur.no_buffer - prev->no_buffer,
+        jitter_avg / 1000, cur.jitter_max / 1000,
+        cur.frames_requested - prev->frames_requested, requested,
+        cur.frames_delivered - prev->frames_delivered, delivered,
+        cur.delay, cur.queued, cur.buffered, bytes_to_ms(__atomic_load_n(&data->ring_lowwater, __ATOMIC_RELAXED)));
+
+    uint64_t cost_avg = (cur.cost_ns - prev->cost_ns) / callbacks;
+    uint64_t cost_p50 = cost_percentile(cur.cost_hist, prev->cost_hist, callbacks, 0.5);
+    uint64_t cost_p99 = cost_percentile(cur.cost_hist, prev->cost_hist, callbacks, 0.99);
+    uint64_t cost_frames = cur.cost_frames - prev->cost_frames;
+    double cycles_per_frame = cost_frames ? (double)(cur.cost_cycles - prev->cost_cycles) / cost_frames : 0;
+
+    deadbeef->log_detailed (&plugin.plugin, DDB_LOG_LAYER_INFO,
+        "PipeWire: process %dbit%s %dch%s%s: avg %" PRIu64 " ns, p50 < %" PRIu64 " ns, p99 < %" PRIu64 " ns, max %" PRIu64 " ns, %.1f cycles/frame\n",
+        plugin.fmt.bps, plugin.fmt.is_float ? " float" : "", plugin.fmt.channels, _convert ? " converted" : "", _planar ? " planar" : "",
+        cost_avg, cost_p50, cost_p99, cur.cost_max, cycles_per_frame);
+
+    uint64_t wakeups = cur.feeder_wakeups - prev->feeder_wakeups;
+    uint64_t wake_avg = wakeups ? (cur.feeder_wake_ns - prev->feeder_wake_ns) / wakeups : 0;
+    uint64_t wake_p99 = wakeups ? cost_percentile(cur.feeder_wake_hist, prev->feeder_wake_hist, wakeups, 0.99) : 0;
+    if (wakeups) {
+        deadbeef->log_detailed (&plugin.plugin, DDB_LOG_LAYER_INFO,
+            "PipeWire: feeder %" PRIu64 " wakeups: avg %" PRIu64 " us, p99 < %" PRIu64 " us, max %" PRIu64 " us\n",
+            wakeups, wake_avg / 1000, wake_p99 / 1000, cur.feeder_wake_max / 1000);
+    }
+
+    if (data->powersave) {
+        deadbeef->log_detailed (&plugin.plugin, DDB_LOG_LAYER_INFO,
+            "PipeWire: %s, %.1f wakeups/s normal, %.1f wakeups/s power saving\n",
+            data->powersave_active ? "power saving" : "normal latency", powersave_wakeups(data, 0), powersave_wakeups(data, 1));
+    }
+
+    struct pw_properties *props = pw_properties_new(NULL, NULL);
+    pw_properties_setf(props, "deadbeef.stats.callbacks", "%" PRIu64, cur.callbacks);
+    pw_properties_setf(props, "deadbeef.stats.underruns", "%" PRIu64, cur.underruns);
+    pw_properties_setf(props, "deadbeef.stats.no-buffer", "%" PRIu64, cur.no_buffer);
+    pw_properties_setf(props, "deadbeef.stats.jitter-avg-us", "%" PRIu64, jitter_avg / 1000);
+    pw_properties_setf(props, "deadbeef.stats.jitter-max-us", "%" PRIu64, cur.jitter_max / 1000);
+    pw_properties_set(props, "deadbeef.stats.requested-hist", requested);
+    pw_properties_set(props, "deadbeef.stats.delivered-hist", delivered);
+    pw_properties_setf(props, "deadbeef.stats.delay", "%" PRId64, cur.delay);
+    pw_properties_setf(props, "deadbeef.stats.queued", "%" PRIu64, cur.queued);
+    pw_properties_setf(props, "deadbeef.stats.buffered", "%" PRIu64, cur.buffered);
+    pw_properties_setf(props, "deadbeef.stats.ring-lowwater-ms", "%u", bytes_to_ms(__atomic_load_n(&data->ring_lowwater, __ATOMIC_RELAXED)));
+    pw_properties_setf(props, "deadbeef.stats.process-avg-ns", "%" PRIu64, cost_avg);
+    pw_properties_setf(props, "deadbeef.stats.process-p99-ns", "%" PRIu64, cost_p99);
+    pw_properties_setf(props, "deadbeef.stats.process-max-ns", "%" PRIu64, cur.cost_max);
+    pw_properties_setf(props, "deadbeef.stats.process-cycles-per-frame", "%.1f", cycles_per_frame);
+    pw_properties_setf(props, "deadbeef.stats.feeder-wake-avg-us", "%" PRIu64, wake_avg / 1000);
+    pw_properties_setf(props, "deadbeef.stats.feeder-wake-p99-us", "%" PRIu64, wake_p99 / 1000);
+    pw_properties_setf(props, "deadbeef.stats.feeder-wake-max-us", "%" PRIu64, cur.feeder_wake_max / 1000);
+    if (data->powersave) {
+        pw_properties_setf(props, "deadbeef.stats.wakeups-per-sec", "%.1f", powersave_wakeups(data, 0));
+        pw_properties_setf(props, "deadbeef.stats.powersave-wakeups-per-sec", "%.1f", powersave_wakeups(data, 1));
+    }
+    pw_stream_update_properties(data->stream, &props->dict);
+    pw_properties_free(props);
+
+    *prev = cur;
+    __atomic_store_n(&data->ring_lowwater, data->ring_target, __ATOMIC_RELAXED);
+}
+
+static void stats_start(void) {
+    int interval = deadbeef->conf_get_int(CONFSTR_DDBPW_STATSINTERVAL, DDBPW_DEFAULT_STATSINTERVAL);
+    struct timespec value = { .tv_sec = interval }, period = { .tv_sec = interval };
+
+    memset(&data.stats, 0, sizeof(data.stats));
+    memset(&data.stats_prev, 0, sizeof(data.stats_prev));
+    if (interval > 0) {
+        pw_loop_update_timer(pw_thread_loop_get_loop(data.loop), data.stats_timer, &value, &period, false);
+    }
+}
+
+// Any thread
+static void transition_record(int which, int64_t ns) {
+    struct transition_stats *t = &transitions[which];
+    uint64_t ms, max;
+
+    if (ns < 0) {
+        return;
+    }
+    ms = ns / SPA_NSEC_PER_MSEC;
+    __atomic_fetch_add(&t->n, 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&t->sum_ns, ns, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&t->hist[ms ? SPA_MIN(64 - __builtin_clzll(ms), DDBPW_TRANSITION_BUCKETS - 1) : 0], 1, __ATOMIC_RELAXED);
+    max = __atomic_load_n(&t->max_ns, __ATOMIC_RELAXED);
+    while ((uint64_t)ns > max && !__atomic_compare_exchange_n(&t->max_ns, &max, ns, false, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+    }
+}
+
+// Any thread, the counts may move while we read them
+static uint32_t transition_percentile(const struct transition_stats *t, uint64_t n, double fraction) {
+    uint64_t sum = 0;
+    for (int i = 0; i < DDBPW_TRANSITION_BUCKETS; i++) {
+        sum += __atomic_load_n(&t->hist[i], __ATOMIC_RELAXED);
+        if (sum >= n * fraction) {
+            return 1u << i;
+        }
+    }
+    return 1u << (DDBPW_TRANSITION_BUCKETS - 1);
+}
+
+static void transitions_log(void) {
+    for (int i = 0; i < DDBPW_TRANSITIONS; i++) {
+        const struct transition_stats *t = &transitions[i];
+        uint64_t n = __atomic_load_n(&t->n, __ATOMIC_RELAXED);
+        if (!n) {
+            continue;
+        }
+        deadbeef->log_detailed (&plugin.plugin, DDB_LOG_LAYER_INFO,
+            "PipeWire: %s %" PRIu64 " times: avg %.1f ms, p50 < %u ms, p99 < %u ms, max %.1f ms\n",
+            transition_names[i], n, __atomic_load_n(&t->sum_ns, __ATOMIC_RELAXED) / 1e6 / n,
+            transition_percentile(t, n, 0.5), transition_percentile(t, n, 0.99),
+            __atomic_load_n(&t->max_ns, __ATOMIC_RELAXED) / 1e6);
+    }
+}
+
+// Runs on the loop thread with the loop lock held
+static void apply_pending_format(struct data *data, int flush) {
+    struct timespec off = { 0, 0 };
+
+    deadbeef->mutex_lock(mutex);
+    if (!_setformat_requested) {
+        deadbeef->mutex_unlock(mutex);
+        return;
+    }
+    pw_loop_update_timer(pw_thread_loop_get_loop(data->loop), data->format_timer, &off, &off, false);
+
+    /* With a flush the RT thread may be halfway through a quantum in the old
+     * format, set_spec must not change stride and converters under it. New
+     * callbacks stay out from here, one that is still running gets to finish
+     * and the timer brings us back instead of waiting for it here. */
+    __atomic_store_n(&data->format_switching, 1, __ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&data->in_process, __ATOMIC_SEQ_CST)) {
+        struct timespec retry = { .tv_nsec = DDBPW_FORMAT_RETRY_MS * SPA_NSEC_PER_MSEC };
+        data->format_flush |= flush;
+        pw_loop_update_timer(pw_thread_loop_get_loop(data->loop), data->format_timer, &retry, &off, false);
+        deadbeef->mutex_unlock(mutex);
+        return;
+    }
+    flush |= data->format_flush;
+    data->format_flush = 0;
+
+    if (flush) {
+        // The RT thread never got to play out the old format, drop what is left of it
+        __atomic_store_n(&data->ring_flush_to, __atomic_load_n(&data->ring.writeindex, __ATOMIC_RELAXED), __ATOMIC_RELAXED);
+        __atomic_store_n(&data->ring_flush, 1, __ATOMIC_RELEASE);
+    }
+
+    ddbpw_set_spec(&requested_fmt);
+
+    // Mirrors may still be behind on the old format, they always start the new one clean
+    __atomic_store_n(&data->ring_flush_to, __atomic_load_n(&data->ring.writeindex, __ATOMIC_RELAXED), __ATOMIC_RELAXED);
+    for (int i = 0; i < data->n_mirrors; i++) {
+        __atomic_store_n(&data->mirrors[i].flush, 1, __ATOMIC_RELEASE);
+    }
+
+    // The RT side sees the cleared first sample before the new switch
+    __atomic_store_n(&data->format_first_sample, 0, __ATOMIC_RELAXED);
+    __atomic_store_n(&data->format_applied, get_monotonic_ns(), __ATOMIC_RELEASE);
+    __atomic_store_n(&_setformat_requested, 0, __ATOMIC_RELEASE);
+    __atomic_store_n(&data->format_switching, 0, __ATOMIC_RELEASE);
+    deadbeef->mutex_unlock(mutex);
+
+    trace("PipeWire: applied format %dHz %dbit (flush %d)\n", plugin.fmt.samplerate, plugin.fmt.bps, flush);
+    trace_event(DDBPW_TRACE_LOOP, DDBPW_EV_FORMAT_APPLIED, plugin.fmt.samplerate, plugin.fmt.bps | plugin.fmt.channels << 8, flush);
+}
+
+static void on_notify(void *userdata, uint64_t count) {
+    struct data *data = userdata;
+    int bits = __atomic_exchange_n(&data->notify, 0, __ATOMIC_ACQUIRE);
+
+    trace_event(DDBPW_TRACE_LOOP, DDBPW_EV_NOTIFY, bits, 0, 0);
+
+    if (bits & DDBPW_NOTIFY_DRAINED) {
+        apply_pending_format(data, 0);
+    }
+    if (bits & DDBPW_NOTIFY_VERIFY) {
+        uint32_t rate = STAT_GET(data->stats.graph_rate);
+        if (rate == plugin.fmt.samplerate) {
+            deadbeef->log_detailed (&plugin.plugin, DDB_LOG_LAYER_INFO,
+                "PipeWire: bit-perfect: graph runs at %uHz, no conversion\n", rate);
+        } else {
+            log_err("PipeWire: bit-perfect: graph runs at %uHz, track is %dHz and gets resampled\n", rate, plugin.fmt.samplerate);
+        }
+    }
+    if (bits & (DDBPW_NOTIFY_PAUSED | DDBPW_NOTIFY_RESUMED)) {
+        // What the graph still holds plays out before anything we just did is heard
+        uint32_t rate = STAT_GET(data->stats.graph_rate);
+        int64_t graph_ns = rate ? STAT_GET(data->stats.delay) * SPA_NSEC_PER_SEC / rate : 0;
+        if (bits & DDBPW_NOTIFY_PAUSED) {
+            int64_t ns = __atomic_load_n(&data->pause_silent, __ATOMIC_RELAXED) - __atomic_load_n(&data->pause_requested, __ATOMIC_RELAXED);
+            transition_record(DDBPW_TRANSITION_PAUSE, ns + graph_ns);
+            deadbeef->log_detailed (&plugin.plugin, DDB_LOG_LAYER_INFO,
+                "PipeWire: pause to silence %.1f ms (%.1f ms of it in the graph)\n",
+                (ns + graph_ns) / 1e6, graph_ns / 1e6);
+        }
+        if (bits & DDBPW_NOTIFY_RESUMED) {
+            int64_t ns = __atomic_load_n(&data->first_sound, __ATOMIC_RELAXED) - __atomic_load_n(&data->unpause_requested, __ATOMIC_RELAXED);
+            transition_record(DDBPW_TRANSITION_UNPAUSE, ns + graph_ns);
+            deadbeef->log_detailed (&plugin.plugin, DDB_LOG_LAYER_INFO,
+                "PipeWire: unpause to sound %.1f ms (%.1f ms of it in the graph, %s pause)\n",
+                (ns + graph_ns) / 1e6, graph_ns / 1e6,
+                data->warm_pause ? "warm" : "cold");
+        }
+    }
+    if (bits & DDBPW_NOTIFY_STARTED) {
+        struct start_times *st = &start_times[data->play_warm];
+        int64_t ns = data->play_first_sample - data->play_requested;
+        transition_record(DDBPW_TRANSITION_PLAY, ns);
+        st->n++;
+        st->sum_ns += ns;
+        deadbeef->log_detailed (&plugin.plugin, DDB_LOG_LAYER_INFO,
+            "PipeWire: %s start, first sample after %.1f ms (cold avg %.1f ms over %" PRIu64 ", warm avg %.1f ms over %" PRIu64 ")\n",
+            data->play_warm ? "warm" : "cold", ns / 1e6,
+            start_times[0].n ? start_times[0].sum_ns / 1e6 / start_times[0].n : 0.0, start_times[0].n,
+            start_times[1].n ? start_times[1].sum_ns / 1e6 / start_times[1].n : 0.0, start_times[1].n);
+    }
+    if (bits & DDBPW_NOTIFY_PREROLLED) {
+        deadbeef->log_detailed (&plugin.plugin, DDB_LOG_LAYER_INFO,
+            "PipeWire: preroll %u of %u ms ready after %.1f ms\n",
+            bytes_to_ms(data->preroll_filled), bytes_to_ms(data->preroll_bytes),
+            (data->preroll_done - data->play_requested) / 1e6);
+        // A pause in the meantime keeps them inactive, unpause activates them
+        if (__atomic_load_n(&state, __ATOMIC_ACQUIRE) == DDB_PLAYBACK_STATE_PLAYING) {
+            pw_stream_set_active(data->stream, 1);
+            for (int i = 0; i < data->n_mirrors; i++) {
+                pw_stream_set_active(data->mirrors[i].stream, 1);
+            }
+        }
+    }
+    if (bits & DDBPW_NOTIFY_METER) {
+        ddb_pw_meter_t m;
+        char peak[DDB_PW_METER_CHANNELS * 8], rms[DDB_PW_METER_CHANNELS * 8];
+        meter_read(data, &m);
+        format_levels(peak, sizeof(peak), m.peak, m.channels);
+        format_levels(rms, sizeof(rms), m.rms, m.channels);
+        struct pw_properties *props = pw_properties_new("deadbeef.meter.peak-db", peak, "deadbeef.meter.rms-db", rms, NULL);
+        pw_stream_update_properties(data->stream, &props->dict);
+        pw_properties_free(props);
+    }
+    if (bits & DDBPW_NOTIFY_LATENCY) {
+        ddb_pw_latency_t l;
+        latency_read(data, &l);
+        deadbeef->sendmessage(DDB_PW_EV_LATENCY_CHANGED, 0, (uint32_t)(l.total / SPA_NSEC_PER_USEC), 0);
+    }
+    if (bits & DDBPW_NOTIFY_SEEKED) {
+        uint32_t rate = STAT_GET(data->stats.graph_rate);
+        int64_t graph_ns = rate ? STAT_GET(data->stats.delay) * SPA_NSEC_PER_SEC / rate : 0;
+        int64_t flushed = __atomic_exchange_n(&data->seek_flushed, 0, __ATOMIC_ACQUIRE);
+        int64_t requested = __atomic_exchange_n(&data->seek_requested, 0, __ATOMIC_RELAXED);
+        if (!requested) {
+            requested = flushed;
+        }
+        if (flushed) {
+            int64_t first_sound = __atomic_load_n(&data->seek_first_sound, __ATOMIC_RELAXED);
+            transition_record(DDBPW_TRANSITION_SEEK, first_sound - requested + graph_ns);
+            deadbeef->log_detailed (&plugin.plugin, DDB_LOG_LAYER_INFO,
+                "PipeWire: seek to sound %.1f ms (%.1f ms in the streamer, %.1f ms in the graph, %d ms quantum)\n",
+                (first_sound - requested + graph_ns) / 1e6, (flushed - requested) / 1e6, graph_ns / 1e6, data->latency_ms);
+        }
+        if (data->seek_active) {
+            struct timespec value = { .tv_nsec = DDBPW_SEEK_HOLD_MS * SPA_NSEC_PER_MSEC }, off = { 0, 0 };
+            pw_loop_update_timer(pw_thread_loop_get_loop(data->loop), data->seek_timer, &value, &off, false);
+        }
+    }
+    if (bits & DDBPW_NOTIFY_WAKE) {
+        data->powersave_secs = 0;
+        powersave_leave(data, __atomic_load_n(&data->powersave_reason, __ATOMIC_RELAXED));
+    }
+    if (bits & DDBPW_NOTIFY_VOLUME) {
+        float volume;
+        __atomic_load(&data->volume_pending, &volume, __ATOMIC_RELAXED);
+        set_volume(0, volume);
+        data->volume_updates++;
+    }
+    if ((bits & DDBPW_NOTIFY_FIRST_SAMPLE) && data->format_requested) {
+        int64_t first_sample = __atomic_load_n(&data->format_first_sample, __ATOMIC_RELAXED);
+        transition_record(DDBPW_TRANSITION_FORMAT, first_sample - data->format_requested);
+        deadbeef->log_detailed (&plugin.plugin, DDB_LOG_LAYER_INFO,
+            "PipeWire: format switch to %dHz %dbit %dch took %" PRId64 " ms (%" PRId64 " ms draining)\n",
+            plugin.fmt.samplerate, plugin.fmt.bps, plugin.fmt.channels,
+            (first_sample - data->format_requested) / SPA_NSEC_PER_MSEC,
+            (__atomic_load_n(&data->format_applied, __ATOMIC_RELAXED) - data->format_requested) / SPA_NSEC_PER_MSEC);
+        data->format_requested = 0;
+    }
+}
+
+/* The old format did not drain in time, most likely because nothing is
+ * pulling from the stream, or a deferred switch is due for another try */
+static void on_format_timeout(void *userdata, uint64_t expirations) {
+    struct data *data = userdata;
+
+    apply_pending_format(data, data->format_switching ? data->format_flush : 1);
+}
+
+static void process_main(struct data *data) {
+    struct pw_buffer *b = NULL;
+    struct spa_buffer *buf = NULL;
+    int64_t start = get_monotonic_ns();
+    uint64_t start_cycles = read_cycles();
+
+    if (__atomic_load_n(&_setformat_requested, __ATOMIC_ACQUIRE)) {
+        // Keep playing the old format until the ring runs dry, then let the loop switch
+        if (ring_fill(&data->ring, &data->ring.readindex) < (uint32_t)_stride) {
+            if (!(__atomic_load_n(&data->notify, __ATOMIC_RELAXED) & DDBPW_NOTIFY_DRAINED)) {
+                trace_event(DDBPW_TRACE_RT, DDBPW_EV_DRAINED, ring_fill(&data->ring, &data->ring.readindex), 0, 0);
+                notify_loop(data, DDBPW_NOTIFY_DRAINED);
+            }
+            return;
+        }
+    }
+
+    // However many volume events came in since the last quantum, the loop applies only the latest
+    if (__atomic_exchange_n(&data->volume_dirty, 0, __ATOMIC_ACQUIRE)) {
+        notify_loop(data, DDBPW_NOTIFY_VOLUME);
+    }
+
+    if (__atomic_exchange_n(&data->ring_flush, 0, __ATOMIC_ACQUIRE)) {
+        ring_discard_to(&data->ring, &data->ring.readindex, __atomic_load_n(&data->ring_flush_to, __ATOMIC_RELAXED));
+    }
+
+    if ((b = pw_stream_dequeue_buffer(data->stream)) == NULL) {
+        pw_log_warn("out of buffers: %m");
+        STAT_ADD(data->stats.no_buffer, 1);
+        trace_event(DDBPW_TRACE_RT, DDBPW_EV_NO_BUFFER, 0, 0, 0);
+        return;
+    }
+
+    buf = b->buffer;
+    uint32_t maxframes = buffer_frames(buf);
+    if (maxframes == 0) {
+        queue_empty_buffer(data->stream, b);
+        return;
+    }
+
+#ifdef ENABLE_BUFFER_OPTION
+    uint32_t buffersize = __atomic_load_n(&_buffersize, __ATOMIC_RELAXED);
+    uint32_t nframes = SPA_MIN(buffersize, maxframes);
+#else
+    uint32_t buffersize = __atomic_load_n(&_buffersize, __ATOMIC_RELAXED);
+    uint32_t nframes = SPA_MIN(buffersize, maxframes);
+#endif
+
+    uint32_t requested = 0;
+#if PW_CHECK_VERSION(0, 3, 49)
+    requested = b->requested;
+    if (b->requested != 0) {
+        nframes = SPA_MIN(b->requested, nframes);
+    }
+    // Makes pw_time.queued count frames, latency_update relies on it
+    b->size = nframes;
+#endif
+
+    int paused = __atomic_load_n(&data->paused, __ATOMIC_ACQUIRE);
+    int bytesread = fill_buffer(&data->ring, &data->ring.readindex, buf, nframes, paused) * _out_stride;
+    uint32_t fill = ring_fill(&data->ring, &data->ring.readindex);
+    if (fill < __atomic_load_n(&data->ring_lowwater, __ATOMIC_RELAXED)) {
+        __atomic_store_n(&data->ring_lowwater, fill, __ATOMIC_RELAXED);
+    }
+    if (!__atomic_load_n(&data->feeder_kick, __ATOMIC_RELAXED)) {
+        __atomic_store_n(&data->feeder_kick, get_monotonic_ns(), __ATOMIC_RELEASE);
+    }
+    sem_post(&data->feeder_sem);
+
+    int len = nframes * _out_stride;
+
+    // One load and compare per quantum while nobody is looking at the levels
+    if (data->meter_props || start - __atomic_load_n(&data->meter_wanted, __ATOMIC_RELAXED) < DDBPW_METER_IDLE_NS) {
+        meter_update(data, buf, nframes, start);
+    } else if (data->meter_running) {
+        data->meter_running = 0;
+    }
+
+    stats_update(data, start, nframes, bytesread / _out_stride, !paused && bytesread < len);
+
+    if (paused && !__atomic_load_n(&data->pause_silent, __ATOMIC_RELAXED)) {
+        __atomic_store_n(&data->pause_silent, start, __ATOMIC_RELAXED);
+        notify_loop(data, DDBPW_NOTIFY_PAUSED);
+    }
+    if (bytesread > 0 && !data->play_first_sample && __atomic_load_n(&data->play_requested, __ATOMIC_ACQUIRE)) {
+        data->play_first_sample = start;
+        notify_loop(data, DDBPW_NOTIFY_STARTED);
+    }
+    if (!paused && bytesread > 0 && __atomic_load_n(&data->unpause_requested, __ATOMIC_ACQUIRE) &&
+            !__atomic_load_n(&data->first_sound, __ATOMIC_RELAXED)) {
+        __atomic_store_n(&data->first_sound, start, __ATOMIC_RELAXED);
+        notify_loop(data, DDBPW_NOTIFY_RESUMED);
+    }
+    if (!paused && bytesread > 0 && __atomic_load_n(&data->seek_flushed, __ATOMIC_ACQUIRE) &&
+            !__atomic_load_n(&data->seek_first_sound, __ATOMIC_RELAXED)) {
+        __atomic_store_n(&data->seek_first_sound, start, __ATOMIC_RELAXED);
+        notify_loop(data, DDBPW_NOTIFY_SEEKED);
+    }
+
+    if (__atomic_load_n(&data->verify_rate, __ATOMIC_ACQUIRE) && bytesread > 0 && STAT_GET(data->stats.graph_rate)) {
+        __atomic_store_n(&data->verify_rate, 0, __ATOMIC_RELAXED);
+        notify_loop(data, DDBPW_NOTIFY_VERIFY);
+    }
+
+    if (bytesread > 0 && __atomic_load_n(&data->format_applied, __ATOMIC_ACQUIRE) &&
+            !__atomic_load_n(&data->format_first_sample, __ATOMIC_RELAXED)) {
+        __atomic_store_n(&data->format_first_sample, get_monotonic_ns(), __ATOMIC_RELAXED);
+        notify_loop(data, DDBPW_NOTIFY_FIRST_SAMPLE);
+    }
+
+    trace_event(DDBPW_TRACE_RT, DDBPW_EV_PROCESS, nframes, requested, bytesread / _out_stride);
+
+    pw_stream_queue_buffer(data->stream, b);
+
+    stats_cost(data, start, start_cycles, nframes);
+}
+
+/* RT side. Every callback is counted in in_process so the loop can tell
+ * when one already started on the format it is about to replace. */
+static void on_process(void *userdata) {
+    struct data *data = userdata;
+
+    __atomic_fetch_add(&data->in_process, 1, __ATOMIC_SEQ_CST);
+    if (!__atomic_load_n(&data->format_switching, __ATOMIC_SEQ_CST)) {
+        process_main(data);
+    }
+    __atomic_fetch_sub(&data->in_process, 1, __ATOMIC_RELEASE);
+}
+
+static void
+set_stream_volume(struct pw_stream *stream, float volume) {
+    float vol[SPA_AUDIO_MAX_CHANNELS] = {0};
+
+    for (int i = 0; i < plugin.fmt.channels; i++) {
+        vol[i] = volume;
+    }
+    pw_stream_set_control(stream, SPA_PROP_channelVolumes, plugin.fmt.channels, vol, 0);
+}
+
+static void
+set_volume(int dolock, float volume) {
+    if (data.stream && __atomic_load_n(&state, __ATOMIC_ACQUIRE) != DDB_PLAYBACK_STATE_STOPPED) {
+        if (dolock) {
+            pw_thread_loop_lock(data.loop);
+        }
+        set_stream_volume(data.stream, volume);
+        __atomic_store(&data.volume_applied, &volume, __ATOMIC_RELAXED);
+        if (dolock) {
+            pw_thread_loop_unlock(data.loop);
+        }
+    }
+}
+
+// Called for every volume event. Only records the value, never touches the loop lock.
+static void queue_volume(float volume) {
+    float applied;
+
+    if (!data.stream || __atomic_load_n(&state, __ATOMIC_ACQUIRE) == DDB_PLAYBACK_STATE_STOPPED) {
+        return;
+    }
+    // Volume events come from whichever thread changed the volume
+    __atomic_fetch_add(&data.volume_events, 1, __ATOMIC_RELAXED);
+
+    __atomic_store(&data.volume_pending, &volume, __ATOMIC_RELAXED);
+    __atomic_load(&data.volume_applied, &applied, __ATOMIC_RELAXED);
+    // Nothing new unless an update is already in flight, which will now carry this value
+    if (volume == applied && !__atomic_load_n(&data.volume_dirty, __ATOMIC_RELAXED)) {
+        return;
+    }
+    if (__atomic_exchange_n(&data.volume_dirty, 1, __ATOMIC_RELEASE)) {
+        return;
+    }
+    // No quanta while paused, hand it to the loop directly
+    if (__atomic_load_n(&state, __ATOMIC_ACQUIRE) != DDB_PLAYBACK_STATE_PLAYING) {
+        __atomic_store_n(&data.volume_dirty, 0, __ATOMIC_RELAXED);
+        notify_loop(&data, DDBPW_NOTIFY_VOLUME);
+    }
+}
+
+static void on_state_changed(void *_data, enum pw_stream_state old,
+        enum pw_stream_state pwstate, const char *error) {
+    trace("PipeWire: Stream state %s\n", pw_stream_state_as_string(pwstate));
+    trace_event(DDBPW_TRACE_LOOP, DDBPW_EV_STREAM_STATE, old, pwstate, 0);
+
+    // A format switch may pass through unconnected, an error still has to stop playback or the stream stays stuck
+    if (_setformat_requested && pwstate != PW_STREAM_STATE_ERROR) {
+        return;
+    }
+
+    if (pwstate == PW_STREAM_STATE_ERROR || (__atomic_load_n(&state, __ATOMIC_ACQUIRE) == DDB_PLAYBACK_STATE_PLAYING && pwstate == PW_STREAM_STATE_UNCONNECTED ) ) {
+        log_err("PipeWire: Stream error: %s\n", error);
+        deadbeef->sendmessage(DB_EV_STOP, 0, 0, 0);
+    }
+}
+
+static void on_control_info(void *_data, uint32_t id, const struct pw_stream_control *control) {
+    uint32_t first = 0;
+    if (control->n_values) {
+        memcpy(&first, &control->values[0], sizeof(first));
+    }
+    trace_event(DDBPW_TRACE_LOOP, DDBPW_EV_CONTROL, id, control->n_values, first);
+
+    if (id == SPA_PROP_channelVolumes && plugin.has_volume) {
+        float dbvol = deadbeef->volume_get_amp();
+        int changedvolume = 0;
+        for (int i = 0; i < control->n_values; i++) {
+            if (control->values[i] != dbvol) {
+                changedvolume = i;
+                break;
+            }
+        }
+
+        // Echo of our own update or a value DeaDBeeF already has
+        float applied;
+        __atomic_load(&data.volume_applied, &applied, __ATOMIC_RELAXED);
+        if (control->values[changedvolume] == dbvol || control->values[changedvolume] == applied) {
+            return;
+        }
+
+        __atomic_store(&data.volume_applied, &control->values[changedvolume], __ATOMIC_RELAXED);
+        deadbeef->volume_set_amp(control->values[changedvolume]);
+    }
+}
+
+/* Asks for a buffer pool of the configured count and size, each buffer
+ * sized for latency_ms when no size is configured. Buffers are MemFd so
+ * that MAP_BUFFERS gives us memory we can pre-fault in on_add_buffer. */
+static void update_buffers_param(struct pw_stream *stream, int latency_ms) {
+    const struct spa_pod *params[1];
+    uint8_t buffer[4096];
+    struct spa_pod_builder b = SPA_POD_BUILDER_INIT(buffer, sizeof(buffer));
+    // Planar buffers carry one block per channel, each a run of floats
+    int blocks = _planar ? plugin.fmt.channels : 1;
+    int stride = _planar ? (int)sizeof(float) : _out_stride;
+    int ms = data.buffer_ms ? data.buffer_ms : latency_ms;
+    int size = ms * plugin.fmt.samplerate / 1000 * stride;
+    int nbuffers = data.nbuffers ? data.nbuffers : 8;
+    int minbuffers = data.nbuffers ? data.nbuffers : 2;
+    int maxbuffers = data.nbuffers ? data.nbuffers : DDBPW_MAX_NBUFFERS;
+
+    if (!data.nbuffers && !data.buffer_ms) {
+        return;
+    }
+
+    params[0] = spa_pod_builder_add_object(&b,
+            SPA_TYPE_OBJECT_ParamBuffers, SPA_PARAM_Buffers,
+            SPA_PARAM_BUFFERS_buffers, SPA_POD_CHOICE_RANGE_Int(nbuffers, minbuffers, maxbuffers),
+            SPA_PARAM_BUFFERS_blocks,  SPA_POD_Int(blocks),
+            SPA_PARAM_BUFFERS_size,    SPA_POD_Int(size),
+            SPA_PARAM_BUFFERS_stride,  SPA_POD_Int(stride),
+            SPA_PARAM_BUFFERS_dataType, SPA_POD_CHOICE_FLAGS_Int(1 << SPA_DATA_MemFd));
+
+    pw_stream_update_params(stream, params, 1);
+}
+
+// Loop thread. Touch every page now so the RT thread never takes a fault on first use.
+static void on_add_buffer(void *userdata, struct pw_buffer *b) {
+    struct spa_buffer *buf = b->buffer;
+
+    for (uint32_t i = 0; i < buf->n_datas; i++) {
+        struct spa_data *d = &buf->datas[i];
+        if (d->data && (d->flags & SPA_DATA_FLAG_WRITABLE)) {
+            memset(d->data, 0, d->maxsize);
+        }
+        data.buffer_bytes += d->maxsize;
+    }
+    data.buffers_added++;
+    trace("PipeWire: added buffer %p, %u datas, type %u\n", (void *)b, buf->n_datas, buf->n_datas ? buf->datas[0].type : 0);
+}
+
+// The ring must hold comfortably more than one quantum or every callback comes up short
+static void update_ring_target(void) {
+    int ms = SPA_MAX(_ringlength, 2 * data.latency_ms);
+    uint64_t want = (uint64_t)ms * plugin.fmt.samplerate / 1000 * _stride;
+    uint32_t target = SPA_MIN(want, data.ring.size);
+    if (want > data.ring.size) {
+        log_err("PipeWire: Ring buffer holds only %u ms of %dch %dHz, not the %d ms asked for\n",
+                bytes_to_ms(data.ring.size), plugin.fmt.channels, plugin.fmt.samplerate, ms);
+    }
+    data.ring_target = target - target % _stride;
+    __atomic_store_n(&data.ring_lowwater, data.ring_target, __ATOMIC_RELAXED);
+}
+
+// Loop thread. Asks the graph for a new quantum on the live stream.
+static void apply_latency(struct data *data) {
+    struct pw_properties *props = pw_properties_new(NULL, NULL);
+
+    trace_event(DDBPW_TRACE_LOOP, DDBPW_EV_LATENCY, data->latency_ms, 0, 0);
+
+    // on_process reads it for its quantum size
+    int buffersize = data->latency_ms * plugin.fmt.samplerate / 1000;
+    __atomic_store_n(&_buffersize, buffersize, __ATOMIC_RELAXED);
+    pw_properties_setf(props, PW_KEY_NODE_LATENCY, "%d/%u", buffersize, plugin.fmt.samplerate);
+    if (_bitperfect) {
+        pw_properties_setf(props, "node.force-quantum", "%d", buffersize);
+    }
+    pw_stream_update_properties(data->stream, &props->dict);
+    for (int i = 0; i < data->n_mirrors; i++) {
+        if (!data->mirrors[i].latency_ms) {
+            pw_stream_update_properties(data->mirrors[i].stream, &props->dict);
+        }
+    }
+    pw_properties_free(props);
+
+    deadbeef->mutex_lock(mutex);
+    update_ring_target();
+    deadbeef->mutex_unlock(mutex);
+    update_buffers_param(data->stream, data->latency_ms);
+    for (int i = 0; i < data->n_mirrors; i++) {
+        if (!data->mirrors[i].latency_ms) {
+            update_buffers_param(data->mirrors[i].stream, data->latency_ms);
+        }
+    }
+}
+
+static void set_latency(struct data *data, int ms, const char *reason) {
+    ms = SPA_CLAMP(ms, data->latency_min_ms, data->latency_max_ms);
+    if (ms == data->latency_ms) {
+        return;
+    }
+    deadbeef->log_detailed (&plugin.plugin, DDB_LOG_LAYER_INFO, "PipeWire: latency %d -> %d ms (%s)\n", data->latency_ms, ms, reason);
+
+    if (data->n_latency_history == DDBPW_LATENCY_HISTORY) {
+        memmove(data->latency_history, data->latency_history + 1, (DDBPW_LATENCY_HISTORY - 1) * sizeof(int));
+        data->n_latency_history--;
+    }
+    data->latency_history[data->n_latency_history++] = ms;
+
+    data->latency_ms = ms;
+    apply_latency(data);
+}
+
+// Grows the quantum quickly on underruns and creeps back down after a quiet period
+static void on_latency_timer(void *userdata, uint64_t expirations) {
+    struct data *data = userdata;
+    uint64_t underruns = STAT_GET(data->stats.underruns);
+    uint64_t delta = underruns - data->latency_underruns;
+    data->latency_underruns = underruns;
+
+    // The power saving quantum is not ours to tune, it goes back to ours on the first underrun
+    if (__atomic_load_n(&state, __ATOMIC_ACQUIRE) != DDB_PLAYBACK_STATE_PLAYING || _setformat_requested || data->powersave_active || data->seek_active) {
+        data->stable_secs = 0;
+        return;
+    }
+
+    if (delta >= DDBPW_ADAPTIVE_UNDERRUNS * expirations) {
+        data->stable_secs = 0;
+        set_latency(data, data->latency_ms * 2, "underruns");
+    }
+    else if (delta > 0) {
+        data->stable_secs = 0;
+    }
+    else if ((data->stable_secs += expirations) >= DDBPW_ADAPTIVE_STABLE_SECS) {
+        data->stable_secs = 0;
+        set_latency(data, data->latency_ms * 3 / 4, "stable");
+    }
+}
+
+static void latency_start(void) {
+    struct timespec value = { .tv_sec = 1 }, period = { .tv_sec = 1 };
+
+    data.adaptive = deadbeef->conf_get_int(CONFSTR_DDBPW_ADAPTIVE, DDBPW_DEFAULT_ADAPTIVE);
+    data.stable_secs = 0;
+    data.latency_underruns = 0;
+    if (data.adaptive) {
+        pw_loop_update_timer(pw_thread_loop_get_loop(data.loop), data.latency_timer, &value, &period, false);
+    }
+}
+
+// Loop thread. The ring has to hold two quanta, so the long one is capped at half of it.
+static void powersave_enter(struct data *data) {
+    uint32_t bytes_per_ms = plugin.fmt.samplerate / 1000 * _stride;
+    int ms = SPA_MIN(data->powersave_ms, bytes_per_ms ? (int)(data->ring.size / bytes_per_ms / 2) : 0);
+
+    if (ms <= data->latency_ms) {
+        return;
+    }
+    deadbeef->log_detailed (&plugin.plugin, DDB_LOG_LAYER_INFO,
+        "PipeWire: power saving after %d s of steady playback, latency %d -> %d ms\n", data->powersave_secs, data->latency_ms, ms);
+    data->powersave_restore_ms = data->latency_ms;
+    data->powersave_active = 1;
+    data->latency_ms = ms;
+    apply_latency(data);
+}
+
+static void powersave_leave(struct data *data, const char *reason) {
+    if (!data->powersave_active) {
+        return;
+    }
+    powersave_account(data, 1);
+    deadbeef->log_detailed (&plugin.plugin, DDB_LOG_LAYER_INFO,
+        "PipeWire: power saving off (%s), latency %d -> %d ms, %.1f wakeups/s while it was on\n",
+        reason, data->latency_ms, data->powersave_restore_ms, powersave_wakeups(data, 1));
+    data->powersave_active = 0;
+    data->latency_ms = data->powersave_restore_ms;
+    apply_latency(data);
+}
+
+// Counts steady seconds and switches to the long quantum once there are enough of them
+static void on_powersave_timer(void *userdata, uint64_t expirations) {
+    struct data *data = userdata;
+    int playing = __atomic_load_n(&state, __ATOMIC_ACQUIRE) == DDB_PLAYBACK_STATE_PLAYING &&
+        !__atomic_load_n(&data->paused, __ATOMIC_ACQUIRE) && !data->prerolling && !_setformat_requested;
+    uint64_t underruns = STAT_GET(data->stats.underruns);
+    uint64_t delta = underruns - data->powersave_underruns;
+    data->powersave_underruns = underruns;
+
+    powersave_account(data, playing);
+    if (!playing) {
+        data->powersave_secs = 0;
+        return;
+    }
+    if (delta > 0) {
+        data->powersave_secs = 0;
+        powersave_leave(data, "underruns");
+        return;
+    }
+    if (data->seek_active) {
+        data->powersave_secs = 0;
+        return;
+    }
+    if (!data->powersave_active && (data->powersave_secs += expirations) >= data->powersave_delay) {
+        powersave_enter(data);
+    }
+}
+
+// Any thread. Seeks, pauses, track and volume changes want the short quantum back right away.
+static void powersave_wake(const char *reason) {
+    if (!data.powersave || !data.stream || __atomic_load_n(&state, __ATOMIC_ACQUIRE) == DDB_PLAYBACK_STATE_STOPPED) {
+        return;
+    }
+    __atomic_store_n(&data.powersave_reason, reason, __ATOMIC_RELAXED);
+    notify_loop(&data, DDBPW_NOTIFY_WAKE);
+}
+
+static void powersave_start(void) {
+    struct timespec value = { .tv_sec = 1 }, period = { .tv_sec = 1 };
+
+    data.powersave = deadbeef->conf_get_int(CONFSTR_DDBPW_POWERSAVE, DDBPW_DEFAULT_POWERSAVE);
+    data.powersave_ms = SPA_MAX(1, deadbeef->conf_get_int(CONFSTR_DDBPW_POWERSAVE_LATENCY, DDBPW_DEFAULT_POWERSAVE_LATENCY));
+    data.powersave_delay = SPA_MAX(1, deadbeef->conf_get_int(CONFSTR_DDBPW_POWERSAVE_DELAY, DDBPW_DEFAULT_POWERSAVE_DELAY));
+    data.powersave_secs = 0;
+    data.powersave_underruns = 0;
+    data.mode_callbacks_mark = 0;
+    data.mode_mark = get_monotonic_ns();
+    if (data.powersave) {
+        pw_loop_update_timer(pw_thread_loop_get_loop(data.loop), data.powersave_timer, &value, &period, false);
+    }
+}
+
+// Loop lock held. Back to the steady quantum, the adaptive and power saving controllers take over again.
+static void seek_end(struct data *data, const char *reason) {
+    struct timespec off = { 0, 0 };
+
+    pw_loop_update_timer(pw_thread_loop_get_loop(data->loop), data->seek_timer, &off, &off, false);
+    if (!data->seek_active) {
+        return;
+    }
+    data->seek_active = 0;
+    deadbeef->log_detailed (&plugin.plugin, DDB_LOG_LAYER_INFO, "PipeWire: latency %d -> %d ms %s\n", data->latency_ms, data->seek_restore_ms, reason);
+    data->latency_ms = data->seek_restore_ms;
+    apply_latency(data);
+}
+
+// Loop thread. The new position had its head start, or never made it to the graph.
+static void on_seek_timer(void *userdata, uint64_t expirations) {
+    struct data *data = userdata;
+
+    seek_end(data, __atomic_load_n(&data->seek_first_sound, __ATOMIC_RELAXED) ? "after seek" : "after seek, new position not heard");
+}
+
+/* Caller thread, after the streamer moved. Drops what is left of the old
+ * position in the ring and in PipeWire and asks for a short quantum so the
+ * first buffers of the new one go out without waiting for a long one. */
+static void ddbpw_seeked(void) {
+    struct timespec off = { 0, 0 };
+    int64_t now = get_monotonic_ns();
+    uint32_t gen;
+    int playing;
+
+    deadbeef->mutex_lock(ctl_mutex);
+    if (!data.loop || !data.stream || data.parked || state == DDB_PLAYBACK_STATE_STOPPED) {
+        deadbeef->mutex_unlock(ctl_mutex);
+        return;
+    }
+
+    pw_thread_loop_lock(data.loop);
+    deadbeef->mutex_lock(mutex);
+    playing = state == DDB_PLAYBACK_STATE_PLAYING && !__atomic_load_n(&data.paused, __ATOMIC_ACQUIRE);
+    gen = __atomic_load_n(&data.seek_gen, __ATOMIC_ACQUIRE);
+    if (gen == data.seek_gen_flushed) {
+        // No DB_EV_SEEK came first, nothing in the ring is known to be from the new position
+        gen = __atomic_add_fetch(&data.seek_gen, 1, __ATOMIC_RELEASE);
+    }
+    data.seek_gen_flushed = gen;
+    // What the feeder read since the seek was requested is the new position already and stays
+    if (data.seek_mark_gen == gen) {
+        __atomic_store_n(&data.ring_flush_to, data.seek_mark, __ATOMIC_RELAXED);
+    } else {
+        __atomic_store_n(&data.ring_flush_to, __atomic_load_n(&data.ring.writeindex, __ATOMIC_RELAXED), __ATOMIC_RELAXED);
+    }
+    __atomic_store_n(&data.ring_flush, 1, __ATOMIC_RELEASE);
+    for (int i = 0; i < data.n_mirrors; i++) {
+        __atomic_store_n(&data.mirrors[i].flush, 1, __ATOMIC_RELEASE);
+    }
+    deadbeef->mutex_unlock(mutex);
+
+    pw_stream_flush(data.stream, 0);
+    for (int i = 0; i < data.n_mirrors; i++) {
+        pw_stream_flush(data.mirrors[i].stream, 0);
+    }
+
+    data.powersave_secs = 0;
+    powersave_leave(&data, "seek");
+
+    // A paused seek only needs the flush, unpause measures itself
+    if (playing) {
+        if (data.seek_ms && (data.seek_active || data.seek_ms < data.latency_ms)) {
+            // The first sound rearms it for the hold, this only ends a seek that is never heard
+            struct timespec fallback = { DDBPW_SEEK_FALLBACK_MS / 1000, DDBPW_SEEK_FALLBACK_MS % 1000 * SPA_NSEC_PER_MSEC };
+            pw_loop_update_timer(pw_thread_loop_get_loop(data.loop), data.seek_timer, &fallback, &off, false);
+            if (!data.seek_active) {
+                data.seek_restore_ms = data.latency_ms;
+                data.seek_active = 1;
+                data.latency_ms = data.seek_ms;
+                apply_latency(&data);
+            }
+        }
+        if (!__atomic_load_n(&data.seek_requested, __ATOMIC_RELAXED)) {
+            __atomic_store_n(&data.seek_requested, now, __ATOMIC_RELAXED);
+        }
+        __atomic_store_n(&data.seek_first_sound, 0, __ATOMIC_RELAXED);
+        __atomic_store_n(&data.seek_flushed, now, __ATOMIC_RELEASE);
+    } else {
+        __atomic_store_n(&data.seek_requested, 0, __ATOMIC_RELAXED);
+    }
+    trace_event(DDBPW_TRACE_CALLER, DDBPW_EV_SEEK, data.seek_active, 0, 0);
+    pw_thread_loop_unlock(data.loop);
+    deadbeef->mutex_unlock(ctl_mutex);
+}
+
+// Loop thread. The stream side must be exactly what we offered, the graph rate is checked once audio flows.
+static void verify_format(const struct spa_pod *param) {
+    struct spa_audio_info_raw info = {0};
+
+    if (spa_format_audio_raw_parse(param, &info) < 0) {
+        log_err("PipeWire: bit-perfect: could not parse the negotiated format\n");
+        return;
+    }
+    if (info.format != data.offered.format || info.rate != data.offered.rate || info.channels != data.offered.channels) {
+        log_err("PipeWire: bit-perfect: negotiated format %u %uHz %uch differs from offered %u %uHz %uch\n",
+            info.format, info.rate, info.channels, data.offered.format, data.offered.rate, data.offered.channels);
+        return;
+    }
+    STAT_SET(data.stats.graph_rate, 0);
+    __atomic_store_n(&data.verify_rate, 1, __ATOMIC_RELEASE);
+}
+
+static void on_param_changed(void *userdata, uint32_t id, const struct spa_pod *param) {
+    if (id != SPA_PARAM_Format || param == NULL) {
+        return;
+    }
+
+    if (plugin.has_volume) {
+        set_volume(0, _initialvol);
+    }
+
+    update_buffers_param(data.stream, data.latency_ms);
+
+    if (_bitperfect) {
+        verify_format(param);
+    }
+}
+
+static void process_mirror(struct mirror *m) {
+    struct ring *r = &data.ring;
+    struct pw_buffer *b = NULL;
+    struct spa_buffer *buf = NULL;
+
+    if (__atomic_exchange_n(&m->flush, 0, __ATOMIC_ACQUIRE)) {
+        ring_discard_to(r, &m->readindex, __atomic_load_n(&data.ring_flush_to, __ATOMIC_RELAXED));
+    }
+
+    if ((b = pw_stream_dequeue_buffer(m->stream)) == NULL) {
+        return;
+    }
+
+    buf = b->buffer;
+    uint32_t maxframes = buffer_frames(buf);
+    if (maxframes == 0) {
+        queue_empty_buffer(m->stream, b);
+        return;
+    }
+
+    int latency_ms = m->latency_ms ? m->latency_ms : data.latency_ms;
+    uint32_t nframes = SPA_MIN((uint32_t)(latency_ms * plugin.fmt.samplerate / 1000), maxframes);
+#if PW_CHECK_VERSION(0, 3, 49)
+    if (b->requested != 0) {
+        nframes = SPA_MIN(b->requested, nframes);
+    }
+#endif
+
+    // So far behind that the feeder may be writing over us, catch up with the main stream
+    if (ring_fill(r, &m->readindex) > r->size - DDBPW_FEEDER_CHUNK) {
+        __atomic_store_n(&m->readindex, __atomic_load_n(&r->readindex, __ATOMIC_ACQUIRE), __ATOMIC_RELAXED);
+        m->resyncs++;
+    }
+
+    uint32_t start = __atomic_load_n(&m->readindex, __ATOMIC_RELAXED);
+    uint32_t got = fill_buffer(r, &m->readindex, buf, nframes, __atomic_load_n(&data.paused, __ATOMIC_ACQUIRE));
+
+    /* The feeder only waits for the main reader and may have lapped us during
+     * the copy. Anything it wrote past start + size landed on what we read. */
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    if (got && __atomic_load_n(&r->writeindex, __ATOMIC_RELAXED) - start > r->size) {
+        fill_buffer(r, &m->readindex, buf, nframes, 1);
+        __atomic_store_n(&m->readindex, __atomic_load_n(&r->readindex, __ATOMIC_ACQUIRE), __ATOMIC_RELAXED);
+        m->resyncs++;
+    }
+
+    pw_stream_queue_buffer(m->stream, b);
+}
+
+// RT side. Mirrors read the same format globals, they stay out of a switch like on_process.
+static void on_mirror_process(void *userdata) {
+    __atomic_fetch_add(&data.in_process, 1, __ATOMIC_SEQ_CST);
+    if (!__atomic_load_n(&data.format_switching, __ATOMIC_SEQ_CST)) {
+        process_mirror(userdata);
+    }
+    __atomic_fetch_sub(&data.in_process, 1, __ATOMIC_RELEASE);
+}
+
+static void on_mirror_state_changed(void *userdata, enum pw_stream_state old,
+        enum pw_stream_state pwstate, const char *error) {
+    struct mirror *m = userdata;
+
+    // A missing room should not stop the others, just say so
+    if (pwstate == PW_STREAM_STATE_ERROR) {
+        log_err("PipeWire: Mirror stream to %s failed: %s\n", m->target, error);
+    }
+}
+
+static void on_mirror_param_changed(void *userdata, uint32_t id, const struct spa_pod *param) {
+    struct mirror *m = userdata;
+
+    if (id != SPA_PARAM_Format || param == NULL) {
+        return;
+    }
+
+    if (!_bitperfect) {
+        set_stream_volume(m->stream, m->volume);
+    }
+
+    update_buffers_param(m->stream, m->latency_ms ? m->latency_ms : data.latency_ms);
+}
+
+// No control_info here, mirrors must not feed their volume back into DeaDBeeF
+static const struct pw_stream_events mirror_events = {
+    PW_VERSION_STREAM_EVENTS,
+    .process = on_mirror_process,
+    .state_changed = on_mirror_state_changed,
+    .param_changed = on_mirror_param_changed,
+    .add_buffer = on_add_buffer,
+};
+
+static const struct pw_stream_events stream_events = {
+    PW_VERSION_STREAM_EVENTS,
+    .process = on_process,
+    .state_changed = on_state_changed,
+    .control_info = on_control_info,
+    .param_changed = on_param_changed,
+    .add_buffer = on_add_buffer,
+};
+
+// Runs on whatever thread asks for it, never with the loop lock held
+static struct pw_properties *media_props_build(DB_playItem_t *track) {
+    int notrackgiven=0;
+
+    ddb_tf_context_t ctx = {
+        ._size = sizeof(ddb_tf_context_t),
+        .flags = DDB_TF_CONTEXT_NO_DYNAMIC,
+        .plt = NULL,
+        .iter = PL_MAIN
+    };
+
+    if (!track) {
+        track = deadbeef->streamer_get_playing_track_safe();
+        if (track == NULL) {
+            return NULL;
         }
         notrackgiven = 1;
     }
 
-    struct spa_dict_item items[3] = {0};
-    int n_items = 0;
+    struct pw_properties *props = pw_properties_new(NULL, NULL);
+    char buf[1000] = {0};
+    const char *artist = NULL;
+    const char *title = NULL;
+
+    ctx.it = track;
+    deadbeef->mutex_lock(mutex);
+    if (tfbytecode && deadbeef->tf_eval(&ctx, tfbytecode, buf, sizeof(buf)) > 0) {
+        pw_properties_set(props, PW_KEY_MEDIA_NAME, buf);
+    }
+    for (int i = 0; i < n_media_tfs; i++) {
+        if (deadbeef->tf_eval(&ctx, media_tfs[i].bytecode, buf, sizeof(buf)) > 0) {
+            pw_properties_set(props, media_tfs[i].key, buf);
+        }
+    }
+    deadbeef->mutex_unlock(mutex);
+
+    deadbeef->pl_lock();
+    artist = deadbeef->pl_find_meta(track, "artist");
+    title = deadbeef->pl_find_meta(track, "title");
+
+    if (artist) {
+        pw_properties_set(props, PW_KEY_MEDIA_ARTIST, artist);
+    }
+
+    if (title) {
+        pw_properties_set(props, PW_KEY_MEDIA_TITLE, title);
+    }
+    deadbeef->pl_unlock();
+
+    if (notrackgiven) {
+        deadbeef->pl_item_unref(track);
+    }
+    return props;
+}
+
+static int media_props_equal(const struct pw_properties *a, const struct pw_properties *b) {
+    if (!a || !b || a->dict.n_items != b->dict.n_items) {
+        return 0;
+    }
+    for (uint32_t i = 0; i < a->dict.n_items; i++) {
+        const char *val = pw_properties_get(b, a->dict.items[i].key);
+        if (!val || strcmp(val, a->dict.items[i].value)) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+// Loop thread. Only the newest pending set is published, older ones were already dropped.
+static int do_publish_media_props(struct spa_loop *loop, bool async, uint32_t seq,
+        const void *_data, size_t size, void *user_data) {
+    struct data *data = user_data;
+    struct pw_properties *props = __atomic_exchange_n(&data->media_pending, NULL, __ATOMIC_ACQUIRE);
+
+    if (!props || !data->stream) {
+        pw_properties_free(props);
+        return 0;
+    }
+
+    if (pw_stream_update_properties(data->stream, &props->dict) < 0) {
+        trace("PipeWire: Error updating properties!\n");
+    }
+    for (int i = 0; i < data->n_mirrors; i++) {
+        pw_stream_update_properties(data->mirrors[i].stream, &props->dict);
+    }
+    pw_properties_free(props);
+    return 0;
+}
 
-    char buf[1000] = {0};
-    const char *artist = NULL;
-    const char *title = NULL;
+static void update_media_props(DB_playItem_t *track) {
+    struct pw_properties *props = media_props_build(track);
 
-    ctx.it = track;
-    if (deadbeef->tf_eval(&ctx, tfbytecode, buf, sizeof(buf)) > 0) {
-        items[n_items++] = SPA_DICT_ITEM_INIT(PW_KEY_MEDIA_NAME, buf);
+    if (!props) {
+        return;
+    }
+    if (media_props_equal(props, data.media_sent)) {
+        data.media_skipped++;
+        pw_properties_free(props);
+        return;
     }
+    pw_properties_free(data.media_sent);
+    data.media_sent = props;
+    data.media_updates++;
 
-    deadbeef->pl_lock();
-    artist = deadbeef->pl_find_meta(track, "artist");
-    title = deadbeef->pl_find_meta(track, "title");
+    pw_properties_free(__atomic_exchange_n(&data.media_pending, pw_properties_copy(props), __ATOMIC_RELEASE));
+    pw_loop_invoke(pw_thread_loop_get_loop(data.loop), do_publish_media_props, 0, NULL, 0, false, &data);
+}
 
-    if (artist) {
-        items[n_items++] = SPA_DICT_ITEM_INIT(PW_KEY_MEDIA_ARTIST, artist);
-    }
+// Parses "key=titleformat;key=titleformat" from the config, caller holds mutex
+static void media_tfs_compile(void) {
+    char conf[sizeof(media_conf)];
+    char *saveptr = NULL;
 
-    if (title) {
-        items[n_items++] = SPA_DICT_ITEM_INIT(PW_KEY_MEDIA_TITLE, title);
+    deadbeef->conf_get_str(CONFSTR_DDBPW_MEDIAPROPS, "", conf, sizeof(conf));
+    if (!strcmp(conf, media_conf)) {
+        return;
     }
+    strcpy(media_conf, conf);
 
-    if (props) {
-        pw_properties_update(props, &SPA_DICT_INIT(items, n_items));
-    } else {
-        rc = pw_stream_update_properties(data.stream, &SPA_DICT_INIT(items, n_items));
-        if (rc < 0) {
-            trace("PipeWire: Error updating properties!\n");
-        }
+    for (int i = 0; i < n_media_tfs; i++) {
+        deadbeef->tf_free(media_tfs[i].bytecode);
     }
+    n_media_tfs = 0;
 
-    deadbeef->pl_unlock();
-    if (notrackgiven) {
-        deadbeef->pl_item_unref(track);
+    for (char *tok = strtok_r(conf, ";", &saveptr); tok && n_media_tfs < DDBPW_MAX_MEDIAPROPS; tok = strtok_r(NULL, ";", &saveptr)) {
+        char *eq = strchr(tok, '=');
+        if (!eq || eq == tok) {
+            continue;
+        }
+        *eq = 0;
+        snprintf(media_tfs[n_media_tfs].key, sizeof(media_tfs[n_media_tfs].key), "%s", tok);
+        media_tfs[n_media_tfs].bytecode = deadbeef->tf_compile(eq + 1);
+        if (media_tfs[n_media_tfs].bytecode) {
+            n_media_tfs++;
+        }
     }
 }
 
-static int ddbpw_init(void) {
-    trace ("ddbpw_init\n");
-
-    my_pw_init();
+static void media_tfs_update(void) {
+    char medianame[256] = {0};
 
-    state = DDB_PLAYBACK_STATE_STOPPED;
-    _setformat_requested = 0;
-    _buffersize = 0;
+    deadbeef->conf_get_str(CONFSTR_DDBPW_MEDIANAME, DDBPW_DEFAULT_MEDIANAME, medianame, sizeof(medianame));
 
-    if (requested_fmt.samplerate != 0) {
-        memcpy (&plugin.fmt, &requested_fmt, sizeof (ddb_waveformat_t));
+    deadbeef->mutex_lock(mutex);
+    if (!tfbytecode || strcmp(medianame, media_name_conf)) {
+        if (tfbytecode) {
+            deadbeef->tf_free(tfbytecode);
+        }
+        tfbytecode = deadbeef->tf_compile(medianame);
+        strcpy(media_name_conf, medianame);
     }
+    media_tfs_compile();
+    deadbeef->mutex_unlock(mutex);
+}
 
-    data.loop = pw_thread_loop_new("ddb_out_pw", NULL);
-
-    char dev[256] = {0};
+static struct pw_properties *make_stream_props(const char *target) {
     char remote[256] = {0};
     char propstr[256] = {0};
-    deadbeef->conf_get_str (PW_PLUGIN_ID "_soundcard", "default", dev, sizeof(dev));
 
     deadbeef->conf_get_str(CONFSTR_DDBPW_REMOTENAME, DDBPW_DEFAULT_REMOTENAME, remote, sizeof(remote));
 
@@ -371,71 +2833,408 @@ static int ddbpw_init(void) {
             PW_KEY_MEDIA_TYPE, "Audio",
             PW_KEY_MEDIA_CATEGORY, "Playback",
             PW_KEY_MEDIA_ROLE, "Music",
-            PW_KEY_NODE_TARGET, (!strcmp(dev, "default")) ? NULL: dev,
+            PW_KEY_NODE_TARGET, target,
             NULL);
-    do_update_media_props(NULL, props);
+    struct pw_properties *media = media_props_build(NULL);
+    if (media) {
+        pw_properties_update(props, &media->dict);
+        pw_properties_free(media);
+    }
     pw_properties_setf(props, PW_KEY_NODE_RATE, "1/%u", plugin.fmt.samplerate);
+    // The adapter reads these only when the node is created
+    if (_bitperfect) {
+        pw_properties_set(props, "channelmix.disable", "true");
+        pw_properties_set(props, PW_KEY_STREAM_DONT_REMIX, "true");
+    }
 
     pw_properties_update_string(props, propstr, strlen(propstr));
+    return props;
+}
+
+static void on_core_error(void *userdata, uint32_t id, int seq, int res, const char *message) {
+    struct data *data = userdata;
+
+    // The daemon went away, a parked connection must not be reused
+    if (id == PW_ID_CORE && res == -EPIPE) {
+        data->core_error = 1;
+    }
+}
+
+static const struct pw_core_events stream_core_events = {
+    PW_VERSION_CORE_EVENTS,
+    .error = on_core_error,
+};
+
+// Everything ddbpw_init reads, a parked connection is only reused while this stays the same
+static void conf_signature(char *buf, size_t size) {
+    char dev[256] = {0};
+    char remote[256] = {0};
+    char mirrors[1024] = {0};
+    char propstr[256] = {0};
+
+    deadbeef->conf_get_str (PW_PLUGIN_ID "_soundcard", "default", dev, sizeof(dev));
+    deadbeef->conf_get_str(CONFSTR_DDBPW_REMOTENAME, DDBPW_DEFAULT_REMOTENAME, remote, sizeof(remote));
+    deadbeef->conf_get_str(CONFSTR_DDBPW_MIRRORS, "", mirrors, sizeof(mirrors));
+    deadbeef->conf_get_str(CONFSTR_DDBPW_PROPS, "", propstr, sizeof(propstr));
+    snprintf(buf, size, "%s|%s|%s|%s|%d|%d|%d|%d|%d|%d|%d|%d",
+        dev, remote, mirrors, propstr,
+        deadbeef->conf_get_int(CONFSTR_DDBPW_RINGLENGTH, DDBPW_DEFAULT_RINGLENGTH),
+        deadbeef->conf_get_int(CONFSTR_DDBPW_ADAPTIVE, DDBPW_DEFAULT_ADAPTIVE),
+        deadbeef->conf_get_int(CONFSTR_DDBPW_ADAPTIVE_MIN, DDBPW_DEFAULT_ADAPTIVE_MIN),
+        deadbeef->conf_get_int(CONFSTR_DDBPW_ADAPTIVE_MAX, DDBPW_DEFAULT_ADAPTIVE_MAX),
+        deadbeef->conf_get_int(CONFSTR_DDBPW_NBUFFERS, DDBPW_DEFAULT_NBUFFERS),
+        deadbeef->conf_get_int(CONFSTR_DDBPW_BUFFERSIZE, DDBPW_DEFAULT_BUFFERSIZE),
+        deadbeef->conf_get_int(CONFSTR_DDBPW_BITPERFECT, DDBPW_DEFAULT_BITPERFECT),
+#ifdef ENABLE_BUFFER_OPTION
+        deadbeef->conf_get_int(CONFSTR_DDBPW_BUFLENGTH, DDBPW_DEFAULT_BUFLENGTH)
+#else
+        0
+#endif
+        );
+}
 
-    data.stream = pw_stream_new_simple(
-            pw_thread_loop_get_loop(data.loop),
+static int ddbpw_init(void) {
+    trace ("ddbpw_init\n");
+
+    my_pw_init();
+
+    __atomic_store_n(&state, DDB_PLAYBACK_STATE_STOPPED, __ATOMIC_RELEASE);
+    _setformat_requested = 0;
+    data.format_switching = 0;
+    data.format_flush = 0;
+    __atomic_store_n(&_buffersize, 0, __ATOMIC_RELAXED);
+
+    if (requested_fmt.samplerate != 0) {
+        memcpy (&plugin.fmt, &requested_fmt, sizeof (ddb_waveformat_t));
+    }
+
+    data.loop = pw_thread_loop_new("ddb_out_pw", NULL);
+    data.stats_timer = pw_loop_add_timer(pw_thread_loop_get_loop(data.loop), on_stats_timer, &data);
+    data.notify_event = pw_loop_add_event(pw_thread_loop_get_loop(data.loop), on_notify, &data);
+    data.format_timer = pw_loop_add_timer(pw_thread_loop_get_loop(data.loop), on_format_timeout, &data);
+    data.latency_timer = pw_loop_add_timer(pw_thread_loop_get_loop(data.loop), on_latency_timer, &data);
+    data.trace_timer = pw_loop_add_timer(pw_thread_loop_get_loop(data.loop), on_trace_timer, &data);
+    data.powersave_timer = pw_loop_add_timer(pw_thread_loop_get_loop(data.loop), on_powersave_timer, &data);
+    data.seek_timer = pw_loop_add_timer(pw_thread_loop_get_loop(data.loop), on_seek_timer, &data);
+    data.seek_active = 0;
+    data.powersave_active = 0;
+    memset(data.mode_callbacks, 0, sizeof(data.mode_callbacks));
+    memset(data.mode_ns, 0, sizeof(data.mode_ns));
+
+    trace_setup();
+    if (__atomic_load_n(&trace_enabled, __ATOMIC_ACQUIRE)) {
+        struct timespec value = { .tv_sec = DDBPW_TRACE_FLUSH_SECS }, period = { .tv_sec = DDBPW_TRACE_FLUSH_SECS };
+        pw_loop_update_timer(pw_thread_loop_get_loop(data.loop), data.trace_timer, &value, &period, false);
+    }
+
+    if (deadbeef->conf_get_int(CONFSTR_DDBPW_ADAPTIVE, DDBPW_DEFAULT_ADAPTIVE)) {
+        data.latency_min_ms = SPA_MAX(1, deadbeef->conf_get_int(CONFSTR_DDBPW_ADAPTIVE_MIN, DDBPW_DEFAULT_ADAPTIVE_MIN));
+        data.latency_max_ms = SPA_MAX(data.latency_min_ms, deadbeef->conf_get_int(CONFSTR_DDBPW_ADAPTIVE_MAX, DDBPW_DEFAULT_ADAPTIVE_MAX));
+        data.latency_ms = data.latency_min_ms;
+    } else {
+#ifdef ENABLE_BUFFER_OPTION
+        data.latency_ms = deadbeef->conf_get_int(CONFSTR_DDBPW_BUFLENGTH, DDBPW_DEFAULT_BUFLENGTH);
+#else
+        data.latency_ms = DDBPW_DEFAULT_BUFLENGTH;
+#endif
+        data.latency_min_ms = data.latency_max_ms = data.latency_ms;
+    }
+    data.nbuffers = SPA_CLAMP(deadbeef->conf_get_int(CONFSTR_DDBPW_NBUFFERS, DDBPW_DEFAULT_NBUFFERS), 0, DDBPW_MAX_NBUFFERS);
+    data.buffer_ms = SPA_MAX(0, deadbeef->conf_get_int(CONFSTR_DDBPW_BUFFERSIZE, DDBPW_DEFAULT_BUFFERSIZE));
+    data.buffers_added = 0;
+    data.buffer_bytes = 0;
+    data.latency_history[0] = data.latency_ms;
+    data.n_latency_history = 1;
+
+    sem_init(&data.feeder_sem, 0, 0);
+    _ringlength = SPA_CLAMP(deadbeef->conf_get_int(CONFSTR_DDBPW_RINGLENGTH, DDBPW_DEFAULT_RINGLENGTH), 10, 2000);
+    if (ring_alloc(&data.ring, _ringlength * (DDBPW_RING_MAX_RATE / 1000) * DDBPW_RING_MAX_STRIDE) < 0) {
+        log_err("PipeWire: Error allocating ring buffer!");
+        return OP_ERROR_INTERNAL;
+    }
+
+    char dev[256] = {0};
+    char mirrors[1024] = {0};
+    char remote[256] = {0};
+    deadbeef->conf_get_str (PW_PLUGIN_ID "_soundcard", "default", dev, sizeof(dev));
+    deadbeef->conf_get_str(CONFSTR_DDBPW_REMOTENAME, DDBPW_DEFAULT_REMOTENAME, remote, sizeof(remote));
+    conf_signature(data.conf_sig, sizeof(data.conf_sig));
+
+    // One core connection shared by all streams, it outlives them when the connection is kept
+    data.context = pw_context_new(pw_thread_loop_get_loop(data.loop), NULL, 0);
+    if (!data.context) {
+        log_err("PipeWire: Error creating context!");
+        return OP_ERROR_INTERNAL;
+    }
+    data.core = pw_context_connect(data.context,
+            pw_properties_new(PW_KEY_REMOTE_NAME, (remote[0] ? remote: NULL), NULL),
+            0);
+    if (!data.core) {
+        log_err("PipeWire: Error connecting to daemon!");
+        if (remote[0]) {
+            log_err("PipeWire: Please check if remote daemon name is valid and daemon is up.\n")
+        }
+        return OP_ERROR_INTERNAL;
+    }
+    data.core_error = 0;
+    spa_zero(data.core_listener);
+    pw_core_add_listener(data.core, &data.core_listener, &stream_core_events, &data);
+
+    data.stream = pw_stream_new(
+            data.core,
             application_title,
-            props,
-            &stream_events,
-            &data);
+            make_stream_props((!strcmp(dev, "default")) ? NULL: dev));
 
     if (!data.stream) {
         log_err("PipeWire: Error creating stream!");
         return OP_ERROR_INTERNAL;
     }
-
+    spa_zero(data.stream_listener);
+    pw_stream_add_listener(data.stream, &data.stream_listener, &stream_events, &data);
+
+    // Comma separated node names, each optionally followed by @latency in ms and %volume
+    deadbeef->conf_get_str(CONFSTR_DDBPW_MIRRORS, "", mirrors, sizeof(mirrors));
+    data.n_mirrors = 0;
+    char *saveptr = NULL;
+    for (char *tok = strtok_r(mirrors, ", ", &saveptr); tok && data.n_mirrors < DDBPW_MAX_MIRRORS; tok = strtok_r(NULL, ", ", &saveptr)) {
+        struct mirror *m = &data.mirrors[data.n_mirrors];
+        char *at = strchr(tok, '@');
+        char *pct = strchr(tok, '%');
+
+        m->latency_ms = 0;
+        m->volume = 1.0f;
+        if (at) {
+            *at = 0;
+            m->latency_ms = SPA_MAX(0, atoi(at + 1));
+        }
+        if (pct) {
+            *pct = 0;
+            m->volume = SPA_CLAMP(atoi(pct + 1), 0, 100) / 100.0f;
+        }
+        snprintf(m->target, sizeof(m->target), "%s", tok);
+        m->readindex = 0;
+        m->flush = 0;
+        m->resyncs = 0;
+        m->stream = pw_stream_new(
+                data.core,
+                application_title,
+                make_stream_props(m->target));
+        if (!m->stream) {
+            log_err("PipeWire: Error creating mirror stream for %s!\n", m->target);
+            continue;
+        }
+        spa_zero(m->listener);
+        pw_stream_add_listener(m->stream, &m->listener, &mirror_events, m);
+        data.n_mirrors++;
+    }
 
     return OP_ERROR_SUCCESS;
 }
 
 static int ddbpw_setformat (ddb_waveformat_t *fmt) {
-    trace("Pipewire: setformat called!\n");
-    deadbeef->mutex_lock(mutex);
-    _setformat_requested = 1;
-    memcpy (&requested_fmt, fmt, sizeof (ddb_waveformat_t));
+    // The feeder only runs while the stream is up, and stop joins it before tearing anything down
+    int ctl = !feeder_thread_self;
 
+    if (ctl) {
+        deadbeef->mutex_lock(ctl_mutex);
+    }
+    trace("Pipewire: setformat called!\n");
+    trace_event(DDBPW_TRACE_CALLER, DDBPW_EV_SETFORMAT, fmt->samplerate, fmt->bps | fmt->channels << 8, 0);
+    powersave_wake("format change");
     if (data.stream == 0) {
+        deadbeef->mutex_lock(mutex);
+        _setformat_requested = 1;
+        memcpy (&requested_fmt, fmt, sizeof (ddb_waveformat_t));
         deadbeef->mutex_unlock(mutex);
+        if (ctl) {
+            deadbeef->mutex_unlock(ctl_mutex);
+        }
         return 0;
     }
+
+    // Always loop lock before mutex, the loop thread takes them in that order too
     pw_thread_loop_lock(data.loop);
-    pw_stream_set_active(data.stream, false);
-    pw_loop_invoke(pw_thread_loop_get_loop(data.loop), _apply_format, 1, NULL, 0, false, NULL);
+    deadbeef->mutex_lock(mutex);
+    memcpy (&requested_fmt, fmt, sizeof (ddb_waveformat_t));
+    if (__atomic_load_n(&state, __ATOMIC_ACQUIRE) == DDB_PLAYBACK_STATE_STOPPED) {
+        // Not connected yet, ddbpw_play will pick it up
+        memcpy (&plugin.fmt, fmt, sizeof (ddb_waveformat_t));
+        deadbeef->mutex_unlock(mutex);
+        pw_thread_loop_unlock(data.loop);
+        if (ctl) {
+            deadbeef->mutex_unlock(ctl_mutex);
+        }
+        return 0;
+    }
+    if (!_setformat_requested) {
+        data.format_requested = get_monotonic_ns();
+        __atomic_store_n(&data.format_applied, 0, __ATOMIC_RELAXED);
+    }
+    __atomic_store_n(&_setformat_requested, 1, __ATOMIC_RELEASE);
+    deadbeef->mutex_unlock(mutex);
+
+    if (__atomic_load_n(&state, __ATOMIC_ACQUIRE) == DDB_PLAYBACK_STATE_PLAYING) {
+        // on_process drains the old format and notifies us, the timer is only a fallback
+        struct timespec value = {
+            .tv_sec = (_ringlength + DDBPW_FORMAT_DRAIN_SLACK_MS) / 1000,
+            .tv_nsec = (_ringlength + DDBPW_FORMAT_DRAIN_SLACK_MS) % 1000 * SPA_NSEC_PER_MSEC
+        };
+        struct timespec interval = { 0, 0 };
+        pw_loop_update_timer(pw_thread_loop_get_loop(data.loop), data.format_timer, &value, &interval, false);
+    } else {
+        apply_pending_format(&data, 1);
+    }
     pw_thread_loop_unlock(data.loop);
+    if (ctl) {
+        deadbeef->mutex_unlock(ctl_mutex);
+    }
 
-    deadbeef->mutex_unlock(mutex);
     return 0;
 }
 
 static int ddbpw_free(void) {
     trace("ddbpw_free\n");
 
-    state = DDB_PLAYBACK_STATE_STOPPED;
+    deadbeef->mutex_lock(ctl_mutex);
+    __atomic_store_n(&state, DDB_PLAYBACK_STATE_STOPPED, __ATOMIC_RELEASE);
 
     if (!data.loop) {
+        deadbeef->mutex_unlock(ctl_mutex);
         return 0;
     }
+    feeder_stop();
+    // Stop the loop before taking the mutex, its callbacks take the mutex as well
+    pw_thread_loop_stop(data.loop);
     deadbeef->mutex_lock(mutex);
 
-    pw_thread_loop_stop(data.loop);
+    // The process callbacks run on the data loop and signal notify_event, they have to be gone first
+    for (int i = 0; i < data.n_mirrors; i++) {
+        if (data.mirrors[i].resyncs) {
+            deadbeef->log_detailed (&plugin.plugin, DDB_LOG_LAYER_INFO, "PipeWire: mirror %s fell behind %u times\n",
+                data.mirrors[i].target, data.mirrors[i].resyncs);
+        }
+        pw_stream_destroy(data.mirrors[i].stream);
+        data.mirrors[i].stream = NULL;
+    }
+    data.n_mirrors = 0;
 
-    pw_stream_destroy(data.stream);
-    data.stream = NULL;
+    if (data.stream) {
+        pw_stream_destroy(data.stream);
+        data.stream = NULL;
+    }
+
+    pw_loop_destroy_source(pw_thread_loop_get_loop(data.loop), data.stats_timer);
+    data.stats_timer = NULL;
+    pw_loop_destroy_source(pw_thread_loop_get_loop(data.loop), data.notify_event);
+    data.notify_event = NULL;
+    pw_loop_destroy_source(pw_thread_loop_get_loop(data.loop), data.format_timer);
+    data.format_timer = NULL;
+    pw_loop_destroy_source(pw_thread_loop_get_loop(data.loop), data.latency_timer);
+    data.latency_timer = NULL;
+    pw_loop_destroy_source(pw_thread_loop_get_loop(data.loop), data.trace_timer);
+    data.trace_timer = NULL;
+    pw_loop_destroy_source(pw_thread_loop_get_loop(data.loop), data.powersave_timer);
+    data.powersave_timer = NULL;
+    pw_loop_destroy_source(pw_thread_loop_get_loop(data.loop), data.seek_timer);
+    data.seek_timer = NULL;
+    trace_flush();
+
+    if (data.adaptive) {
+        char history[DDBPW_LATENCY_HISTORY * 8] = { 0 };
+        size_t pos = 0;
+        for (int i = 0; i < data.n_latency_history && pos < sizeof(history); i++) {
+            pos += snprintf(history + pos, sizeof(history) - pos, "%s%d", i ? " " : "", data.latency_history[i]);
+        }
+        deadbeef->log_detailed (&plugin.plugin, DDB_LOG_LAYER_INFO, "PipeWire: latency history (ms): %s\n", history);
+    }
+    if (data.powersave) {
+        powersave_account(&data, 0);
+        deadbeef->log_detailed (&plugin.plugin, DDB_LOG_LAYER_INFO,
+            "PipeWire: %.1f wakeups/s over %.0f s normal, %.1f wakeups/s over %.0f s power saving\n",
+            powersave_wakeups(&data, 0), data.mode_ns[0] / 1e9, powersave_wakeups(&data, 1), data.mode_ns[1] / 1e9);
+    }
+
+    if (data.core) {
+        spa_hook_remove(&data.core_listener);
+        pw_core_disconnect(data.core);
+        data.core = NULL;
+    }
+    if (data.context) {
+        pw_context_destroy(data.context);
+        data.context = NULL;
+    }
+    data.parked = 0;
 
     pw_thread_loop_destroy(data.loop);
     data.loop = NULL;
+
+    transitions_log();
+    if (data.ring_target) {
+        deadbeef->log_detailed (&plugin.plugin, DDB_LOG_LAYER_INFO, "PipeWire: ring buffer %u ms, low-water mark %u ms\n",
+            bytes_to_ms(data.ring_target), bytes_to_ms(__atomic_load_n(&data.ring_lowwater, __ATOMIC_RELAXED)));
+    }
+    data.ring_target = 0;
+    uint64_t volume_events = __atomic_exchange_n(&data.volume_events, 0, __ATOMIC_RELAXED);
+    if (volume_events) {
+        deadbeef->log_detailed (&plugin.plugin, DDB_LOG_LAYER_INFO, "PipeWire: %" PRIu64 " volume events, %" PRIu64 " stream updates\n",
+            volume_events, data.volume_updates);
+    }
+    data.volume_updates = 0;
+    data.paused = 0;
+    data.prerolling = 0;
+    data.unpause_requested = 0;
+    data.play_requested = 0;
+    memset(&data.out_latency, 0, sizeof(data.out_latency));
+    data.out_latency_reported = 0;
+    if (data.media_updates || data.media_skipped) {
+        deadbeef->log_detailed (&plugin.plugin, DDB_LOG_LAYER_INFO, "PipeWire: %" PRIu64 " metadata updates published, %" PRIu64 " unchanged skipped\n",
+            data.media_updates, data.media_skipped);
+    }
+    data.media_updates = data.media_skipped = 0;
+    if (data.buffers_added) {
+        deadbeef->log_detailed (&plugin.plugin, DDB_LOG_LAYER_INFO, "PipeWire: %u buffers mapped, %" PRIu64 " KiB pre-faulted\n",
+            data.buffers_added, data.buffer_bytes / 1024);
+    }
+    pw_properties_free(__atomic_exchange_n(&data.media_pending, NULL, __ATOMIC_ACQUIRE));
+    pw_properties_free(data.media_sent);
+    data.media_sent = NULL;
+    data.volume_dirty = 0;
+    data.volume_applied = 0.0f;
+    ring_free(&data.ring);
+    sem_destroy(&data.feeder_sem);
     deadbeef->mutex_unlock(mutex);
     my_pw_deinit();
+    deadbeef->mutex_unlock(ctl_mutex);
     return OP_ERROR_SUCCESS;
 }
 
-static void set_channel_map(int channels, struct spa_audio_info_raw* audio_info) {
+// SPA position for each ddb channelmask bit, in bit order (the WAVEFORMATEXTENSIBLE layout)
+static const uint32_t channelmask_positions[] = {
+    SPA_AUDIO_CHANNEL_FL,   // DDB_SPEAKER_FRONT_LEFT
+    SPA_AUDIO_CHANNEL_FR,   // DDB_SPEAKER_FRONT_RIGHT
+    SPA_AUDIO_CHANNEL_FC,   // DDB_SPEAKER_FRONT_CENTER
+    SPA_AUDIO_CHANNEL_LFE,  // DDB_SPEAKER_LOW_FREQUENCY
+    SPA_AUDIO_CHANNEL_RL,   // DDB_SPEAKER_BACK_LEFT
+    SPA_AUDIO_CHANNEL_RR,   // DDB_SPEAKER_BACK_RIGHT
+    SPA_AUDIO_CHANNEL_FLC,  // DDB_SPEAKER_FRONT_LEFT_OF_CENTER
+    SPA_AUDIO_CHANNEL_FRC,  // DDB_SPEAKER_FRONT_RIGHT_OF_CENTER
+    SPA_AUDIO_CHANNEL_RC,   // DDB_SPEAKER_BACK_CENTER
+    SPA_AUDIO_CHANNEL_SL,   // DDB_SPEAKER_SIDE_LEFT
+    SPA_AUDIO_CHANNEL_SR,   // DDB_SPEAKER_SIDE_RIGHT
+    SPA_AUDIO_CHANNEL_TC,   // DDB_SPEAKER_TOP_CENTER
+    SPA_AUDIO_CHANNEL_TFL,  // DDB_SPEAKER_TOP_FRONT_LEFT
+    SPA_AUDIO_CHANNEL_TFC,  // DDB_SPEAKER_TOP_FRONT_CENTER
+    SPA_AUDIO_CHANNEL_TFR,  // DDB_SPEAKER_TOP_FRONT_RIGHT
+    SPA_AUDIO_CHANNEL_TRL,  // DDB_SPEAKER_TOP_BACK_LEFT
+    SPA_AUDIO_CHANNEL_TRC,  // DDB_SPEAKER_TOP_BACK_CENTER
+    SPA_AUDIO_CHANNEL_TRR,  // DDB_SPEAKER_TOP_BACK_RIGHT
+};
+
+// One position per ddb speaker bit, a negative array size breaks the build otherwise
+typedef char channelmask_positions_check[SPA_N_ELEMENTS(channelmask_positions) == DDBPW_RING_MAX_CHANNELS ? 1 : -1];
+
+// Used when the channelmask does not describe the stream
+static void set_channel_map_by_count(int channels, struct spa_audio_info_raw* audio_info) {
     /* Following http://www.microsoft.com/whdc/device/audio/multichaud.mspx#EKLAC */
 
     switch (channels) {
@@ -493,7 +3292,26 @@ static void set_channel_map(int channels, struct spa_audio_info_raw* audio_info)
     }
 }
 
-static struct spa_pod * makeformat(ddb_waveformat_t *fmt, uint8_t *buffer, size_t buffer_size) {
+/* Samples come interleaved in the order of the channelmask bits, so the
+ * positions follow the bits. That lets layouts like 5.1 side or quad with
+ * back speakers pass through without channelmix guessing. */
+static void set_channel_map(int channels, uint32_t channelmask, struct spa_audio_info_raw* audio_info) {
+    uint32_t mask = channelmask & ((1u << SPA_N_ELEMENTS(channelmask_positions)) - 1);
+
+    // ddb tags mono as front left, that would only play on one speaker
+    if (channels == 1 || __builtin_popcount(mask) != channels || channels > SPA_AUDIO_MAX_CHANNELS) {
+        set_channel_map_by_count(channels, audio_info);
+        return;
+    }
+
+    int i = 0;
+    while (mask) {
+        audio_info->position[i++] = channelmask_positions[__builtin_ctz(mask)];
+        mask &= mask - 1;
+    }
+}
+
+static int format_to_raw(ddb_waveformat_t *fmt, int convert, struct spa_audio_info_raw *rawinfo) {
 
     enum spa_audio_format pwfmt = 0;
 
@@ -516,152 +3334,677 @@ static struct spa_pod * makeformat(ddb_waveformat_t *fmt, uint8_t *buffer, size_
         }
         break;
     default:
-        return NULL;
+        return -1;
     };
 
+    if (convert == DDBPW_CONVERT_F32) {
+        pwfmt = SPA_AUDIO_FORMAT_F32_LE;
+    }
+    else if (convert == DDBPW_CONVERT_S24_32) {
+        pwfmt = SPA_AUDIO_FORMAT_S24_32_LE;
+    }
+    else if (convert == DDBPW_CONVERT_F32P) {
+        pwfmt = SPA_AUDIO_FORMAT_F32P;
+    }
 
 
-    struct spa_pod_builder b = SPA_POD_BUILDER_INIT(buffer, buffer_size);
 
-    struct spa_audio_info_raw rawinfo =  SPA_AUDIO_INFO_RAW_INIT(
+    *rawinfo =  SPA_AUDIO_INFO_RAW_INIT(
         .flags = 0,
         .format = pwfmt,
         .channels = fmt->channels,
         .rate = fmt->samplerate
     );
 
-    set_channel_map(fmt->channels, &rawinfo);
+    set_channel_map(fmt->channels, fmt->channelmask, rawinfo);
+    return 0;
+}
+
+static struct spa_pod * makeformat(ddb_waveformat_t *fmt, int convert, uint8_t *buffer, size_t buffer_size) {
+    struct spa_pod_builder b = SPA_POD_BUILDER_INIT(buffer, buffer_size);
+    struct spa_audio_info_raw rawinfo;
+
+    if (format_to_raw(fmt, convert, &rawinfo) < 0) {
+        return NULL;
+    }
+    data.offered = rawinfo;
+
+    return spa_format_audio_raw_build(&b, SPA_PARAM_EnumFormat, &rawinfo);
+
+}
+
+// Mirrors follow the main stream's format, with their own latency if one was configured
+static void mirrors_set_spec(const struct spa_pod **params) {
+    for (int i = 0; i < data.n_mirrors; i++) {
+        struct mirror *m = &data.mirrors[i];
+        struct pw_properties *props = pw_properties_new(NULL, NULL);
+        int latency = (m->latency_ms ? m->latency_ms : data.latency_ms) * plugin.fmt.samplerate / 1000;
+        int res;
+
+        pw_properties_setf(props, PW_KEY_NODE_LATENCY, "%d/%u", latency, plugin.fmt.samplerate);
+        pw_properties_setf(props, PW_KEY_NODE_RATE, "1/%u", plugin.fmt.samplerate);
+        pw_stream_update_properties(m->stream, &props->dict);
+        pw_properties_free(props);
+
+        if (pw_stream_get_state(m->stream, NULL) != PW_STREAM_STATE_UNCONNECTED) {
+            res = pw_stream_update_params(m->stream, params, 1);
+        } else {
+            m->readindex = __atomic_load_n(&data.ring.readindex, __ATOMIC_ACQUIRE);
+            res = pw_stream_connect(m->stream,
+                    PW_DIRECTION_OUTPUT,
+                    PW_ID_ANY,
+                    PW_STREAM_FLAG_AUTOCONNECT |
+                    PW_STREAM_FLAG_MAP_BUFFERS |
+                    PW_STREAM_FLAG_RT_PROCESS |
+                    (data.prerolling ? PW_STREAM_FLAG_INACTIVE : 0),
+                    params, 1);
+        }
+        if (res < 0) {
+            log_err("PipeWire: Error setting up mirror stream for %s!\n", m->target);
+        }
+    }
+}
+
+/* Chooses the output conversion for plugin.fmt and the kernels and strides
+ * the RT path works with. Returns the conversion actually in effect. */
+static int setup_convert(void) {
+    _stride = plugin.fmt.channels * (plugin.fmt.bps / 8);
+
+    // Bit-perfect hands PipeWire exactly what the decoder produced
+    int convert = _bitperfect ? DDBPW_CONVERT_OFF : deadbeef->conf_get_int(CONFSTR_DDBPW_CONVERT, DDBPW_DEFAULT_CONVERT);
+    // Planar converts to interleaved float first, float input only needs the deinterleave
+    _convert = select_convert(&plugin.fmt, convert == DDBPW_CONVERT_F32P ? DDBPW_CONVERT_F32 : convert);
+    if (convert == DDBPW_CONVERT_F32P && !_convert && !plugin.fmt.is_float) {
+        convert = DDBPW_CONVERT_OFF;
+    }
+    else if (convert != DDBPW_CONVERT_F32P && !_convert) {
+        convert = DDBPW_CONVERT_OFF;
+    }
+    _planar = convert == DDBPW_CONVERT_F32P;
+    _deinterleave = _planar ? select_deinterleave() : NULL;
+    _meter_f32 = select_meter();
+    _out_stride = convert == DDBPW_CONVERT_OFF ? _stride : plugin.fmt.channels * 4;
+    return convert;
+}
+
+static int ddbpw_set_spec(ddb_waveformat_t *fmt) {
+    memcpy (&plugin.fmt, fmt, sizeof (ddb_waveformat_t));
+    if (!plugin.fmt.channels) {
+        // generic format
+        plugin.fmt.bps = 16;
+        plugin.fmt.is_float = 0;
+        plugin.fmt.channels = 2;
+        plugin.fmt.samplerate = 44100;
+        plugin.fmt.channelmask = 3;
+    }
+    if (_nativeformat) {
+        sink_native_format(&plugin.fmt);
+    }
+
+    trace ("format %dbit %s %dch %dHz channelmask=%X\n", plugin.fmt.bps, plugin.fmt.is_float ? "float" : "int", plugin.fmt.channels, plugin.fmt.samplerate, plugin.fmt.channelmask);
+    int convert = setup_convert();
+
+    uint8_t spa_buffer[1024];
+    const struct spa_pod *params[1] = {
+        makeformat(&plugin.fmt, convert, spa_buffer, sizeof (spa_buffer))
+    };
+
+    struct pw_properties *props = pw_properties_new(NULL, NULL);
+    int buffersize = data.latency_ms * plugin.fmt.samplerate / 1000;
+    __atomic_store_n(&_buffersize, buffersize, __ATOMIC_RELAXED);
+    pw_properties_setf(props, PW_KEY_NODE_LATENCY, "%d/%u", buffersize, plugin.fmt.samplerate);
+
+    pw_properties_setf(props, PW_KEY_NODE_RATE, "1/%u", plugin.fmt.samplerate);
+    // NODE_RATE is only a hint, these make the graph actually follow the track
+    if (_bitperfect) {
+        pw_properties_setf(props, "node.force-rate", "%u", plugin.fmt.samplerate);
+        pw_properties_setf(props, "node.force-quantum", "%d", buffersize);
+    }
+    pw_stream_update_properties(data.stream, &props->dict);
+    pw_properties_free(props);
+
+    update_ring_target();
+    mirrors_set_spec(params);
+
+    // A live stream just renegotiates, only a fresh one has to be connected
+    if (pw_stream_get_state(data.stream, NULL) != PW_STREAM_STATE_UNCONNECTED) {
+        if (pw_stream_update_params(data.stream, params, 1) < 0) {
+            log_err("PipeWire: Error updating stream format!\n");
+            return OP_ERROR_INTERNAL;
+        }
+        return OP_ERROR_SUCCESS;
+    }
+
+    if (0 != pw_stream_connect(data.stream,
+                PW_DIRECTION_OUTPUT,
+                PW_ID_ANY,
+                PW_STREAM_FLAG_AUTOCONNECT |
+                PW_STREAM_FLAG_MAP_BUFFERS |
+                PW_STREAM_FLAG_RT_PROCESS |
+                (data.prerolling ? PW_STREAM_FLAG_INACTIVE : 0),
+                params, 1)) {
+        log_err("PipeWire: Error connecting stream!\n");
+        if (pw_properties_get(pw_stream_get_properties(data.stream), PW_KEY_REMOTE_NAME)) {
+            log_err("PipeWire: Please check if remote daemon name is valid and daemon is up.\n")
+        }
+        return OP_ERROR_INTERNAL;
+    };
+
+
+    __atomic_store_n(&state, DDB_PLAYBACK_STATE_PLAYING, __ATOMIC_RELEASE);
+
+    return OP_ERROR_SUCCESS;
+}
+
+static void update_has_volume(void) {
+    _bitperfect = deadbeef->conf_get_int(CONFSTR_DDBPW_BITPERFECT, DDBPW_DEFAULT_BITPERFECT);
+    _nativeformat = deadbeef->conf_get_int(CONFSTR_DDBPW_NATIVEFORMAT, DDBPW_DEFAULT_NATIVEFORMAT);
+    // Any volume other than unity would modify the samples
+    plugin.has_volume = !_bitperfect && deadbeef->conf_get_int(CONFSTR_DDBPW_VOLUMECONTROL, DDBPW_DEFAULT_VOLUMECONTROL);
+}
+
+static void feeder_wait(int ms) {
+    struct timespec ts;
+    int res;
+
+    // Only a kick that arrives while we sleep says anything about wakeup latency
+    int64_t sleep_start = get_monotonic_ns();
+    __atomic_store_n(&data.feeder_kick, 0, __ATOMIC_RELAXED);
+
+    clock_gettime(CLOCK_REALTIME, &ts);
+    ts.tv_nsec += ms * SPA_NSEC_PER_MSEC;
+    ts.tv_sec += ts.tv_nsec / SPA_NSEC_PER_SEC;
+    ts.tv_nsec %= SPA_NSEC_PER_SEC;
+    while ((res = sem_timedwait(&data.feeder_sem, &ts)) == -1 && errno == EINTR);
+
+    int64_t kick = __atomic_exchange_n(&data.feeder_kick, 0, __ATOMIC_ACQUIRE);
+    if (res == 0 && kick >= sleep_start) {
+        struct stats *st = &data.stats;
+        uint64_t ns = get_monotonic_ns() - kick;
+        STAT_ADD(st->feeder_wakeups, 1);
+        STAT_ADD(st->feeder_wake_ns, ns);
+        STAT_ADD(st->feeder_wake_hist[cost_bucket(ns)], 1);
+        if (ns > STAT_GET(st->feeder_wake_max)) {
+            STAT_SET(st->feeder_wake_max, ns);
+        }
+        trace_event(DDBPW_TRACE_FEEDER, DDBPW_EV_FEEDER_WAKE, ns / SPA_NSEC_PER_USEC, 0, 0);
+    }
+}
+
+// "2,3" or "0-1,6" as in taskset -c, returns the number of CPUs set
+static int parse_cpu_list(const char *list, cpu_set_t *set) {
+    CPU_ZERO(set);
+    const char *p = list;
+    while (*p) {
+        char *end;
+        long first = strtol(p, &end, 10);
+        if (end == p) {
+            return -1;
+        }
+        long last = first;
+        p = end;
+        if (*p == '-') {
+            last = strtol(p+1, &end, 10);
+            if (end == p+1) {
+                return -1;
+            }
+            p = end;
+        }
+        if (first < 0 || last < first || last >= CPU_SETSIZE) {
+            return -1;
+        }
+        for (long cpu = first; cpu <= last; cpu++) {
+            CPU_SET(cpu, set);
+        }
+        while (*p == ',' || *p == ' ') {
+            p++;
+        }
+    }
+    return CPU_COUNT(set);
+}
+
+static const char *sched_policy_name(int policy) {
+    switch (policy & ~SCHED_RESET_ON_FORK) {
+    case SCHED_FIFO: return "SCHED_FIFO";
+    case SCHED_RR: return "SCHED_RR";
+    default: return "SCHED_OTHER";
+    }
+}
+
+/* Runs on the feeder itself. Real-time scheduling is tried directly first,
+ * which works with an RLIMIT_RTPRIO grant, then through PipeWire's thread
+ * utils, which go through RTKit when module-rt is loaded in our context.
+ * RTKit picks the policy itself. When neither works, or no real-time policy
+ * is configured, the thread is only reniced, and only if a nice level is set. */
+static void feeder_setup(void) {
+    int policy = deadbeef->conf_get_int(CONFSTR_DDBPW_FEEDER_POLICY, DDBPW_DEFAULT_FEEDER_POLICY);
+    int priority = deadbeef->conf_get_int(CONFSTR_DDBPW_FEEDER_PRIORITY, DDBPW_DEFAULT_FEEDER_PRIORITY);
+    int nice = deadbeef->conf_get_int(CONFSTR_DDBPW_FEEDER_NICE, DDBPW_DEFAULT_FEEDER_NICE);
+    char cpus[256];
+    deadbeef->conf_get_str(CONFSTR_DDBPW_FEEDER_CPUS, DDBPW_DEFAULT_FEEDER_CPUS, cpus, sizeof(cpus));
+
+    pthread_t self = pthread_self();
+    const char *how = NULL;
+    int res = 0;
+
+    // Makes the thread easy to find for top -H and taskset
+    pthread_setname_np(self, "ddb_pw_feeder");
+
+    if (policy == 1 || policy == 2) {
+        int sched = policy == 1 ? SCHED_FIFO : SCHED_RR;
+        struct sched_param param = { .sched_priority = SPA_CLAMP(priority, sched_get_priority_min(sched), sched_get_priority_max(sched)) };
+        if ((res = pthread_setschedparam(self, sched, &param)) == 0) {
+            how = "directly";
+        }
+#if PW_CHECK_VERSION(0, 3, 31)
+        else if (data.context && pw_thread_utils_acquire_rt((struct spa_thread *)self, param.sched_priority) == 0) {
+            how = "through RTKit";
+        }
+#endif
+    }
+
+    if (how) {
+        int sched;
+        struct sched_param param;
+        pthread_getschedparam(self, &sched, &param);
+        deadbeef->log_detailed (&plugin.plugin, DDB_LOG_LAYER_INFO, "PipeWire: feeder thread %s priority %d (%s)\n",
+            sched_policy_name(sched), param.sched_priority, how);
+    }
+    else if (nice != 0) {
+        if (setpriority(PRIO_PROCESS, syscall(SYS_gettid), nice) == 0) {
+            deadbeef->log_detailed (&plugin.plugin, DDB_LOG_LAYER_INFO, "PipeWire: feeder thread nice %d%s\n",
+                nice, policy ? ", real-time scheduling was refused" : "");
+        }
+        else {
+            log_err("PipeWire: could not set feeder thread priority (%s)\n", strerror(errno));
+        }
+    }
+    else if (policy) {
+        log_err("PipeWire: real-time scheduling for the feeder thread was refused (%s)\n", strerror(res));
+    }
+
+    if (*cpus) {
+        cpu_set_t set;
+        if (parse_cpu_list(cpus, &set) <= 0) {
+            log_err("PipeWire: invalid feeder CPU list \"%s\"\n", cpus);
+        }
+        else if ((res = pthread_setaffinity_np(self, sizeof(set), &set)) != 0) {
+            log_err("PipeWire: could not pin feeder thread to CPUs %s (%s)\n", cpus, strerror(res));
+        }
+        else {
+            deadbeef->log_detailed (&plugin.plugin, DDB_LOG_LAYER_INFO, "PipeWire: feeder thread pinned to CPUs %s\n", cpus);
+        }
+    }
+}
 
-    return spa_format_audio_raw_build(&b, SPA_PARAM_EnumFormat, &rawinfo);
+// Feeder side. Once the preroll is in the ring, or it is taking too long, the loop activates the streams.
+static void preroll_check(void) {
+    int64_t now = get_monotonic_ns();
+    uint32_t fill = ring_fill(&data.ring, &data.ring.readindex);
 
+    if (fill < data.preroll_bytes && now - data.play_requested < (data.preroll_ms + DDBPW_PREROLL_TIMEOUT_MS) * SPA_NSEC_PER_MSEC) {
+        return;
+    }
+    data.preroll_filled = fill;
+    data.preroll_done = now;
+    __atomic_store_n(&data.prerolling, 0, __ATOMIC_RELEASE);
+    notify_loop(&data, DDBPW_NOTIFY_PREROLLED);
 }
 
-static int ddbpw_set_spec(ddb_waveformat_t *fmt) {
-    memcpy (&plugin.fmt, fmt, sizeof (ddb_waveformat_t));
-    if (!plugin.fmt.channels) {
-        // generic format
-        plugin.fmt.bps = 16;
-        plugin.fmt.is_float = 0;
-        plugin.fmt.channels = 2;
-        plugin.fmt.samplerate = 44100;
-        plugin.fmt.channelmask = 3;
+// Feeder side, mutex held. Notes where the first bytes read after the latest seek request start.
+static uint32_t feeder_write(const void *src, uint32_t len, uint32_t seek_gen) {
+    if (seek_gen != data.seek_mark_gen) {
+        data.seek_mark = __atomic_load_n(&data.ring.writeindex, __ATOMIC_RELAXED);
+        data.seek_mark_gen = seek_gen;
     }
+    return ring_write(&data.ring, src, len);
+}
 
-    trace ("format %dbit %s %dch %dHz channelmask=%X\n", plugin.fmt.bps, plugin.fmt.is_float ? "float" : "int", plugin.fmt.channels, plugin.fmt.samplerate, plugin.fmt.channelmask);
-    _stride = plugin.fmt.channels * (plugin.fmt.bps / 8);
-
-    uint8_t spa_buffer[1024];
-    const struct spa_pod *params[1] = {
-        makeformat(&plugin.fmt, spa_buffer, sizeof (spa_buffer))
-    };
-
-    struct pw_properties *props = pw_properties_new(NULL, NULL);
-#ifdef ENABLE_BUFFER_OPTION
-    _buffersize = deadbeef->conf_get_int(CONFSTR_DDBPW_BUFLENGTH, DDBPW_DEFAULT_BUFLENGTH) * plugin.fmt.samplerate / 1000;
-    pw_properties_setf(props, PW_KEY_NODE_LATENCY, "%d/%u", _buffersize, plugin.fmt.samplerate);
-#else
-    _buffersize = DDBPW_DEFAULT_BUFLENGTH * plugin.fmt.samplerate / 1000;
-    pw_properties_setf(props, PW_KEY_NODE_LATENCY, "%d/%u", _buffersize, plugin.fmt.samplerate);
-#endif
+// Keeps the ring topped up from the streamer so on_process never has to call into DeaDBeeF
+static void feeder_thread(void *ctx) {
+    // Bytes of feeder_chunk held back for the format that is being switched to
+    uint32_t stashed = 0;
+    uint32_t stash_pos = 0;
+    uint32_t stash_gen = 0;
+
+    feeder_thread_self = 1;
+    feeder_setup();
+    while (!__atomic_load_n(&data.feeder_quit, __ATOMIC_ACQUIRE)) {
+        if (__atomic_load_n(&data.prerolling, __ATOMIC_ACQUIRE)) {
+            preroll_check();
+        }
+        deadbeef->mutex_lock(mutex);
+        // The switch is through, the stash goes ahead of anything read from now on
+        if (stashed && !_setformat_requested) {
+            uint32_t written = feeder_write(data.feeder_chunk + stash_pos, stashed, stash_gen);
+            stash_pos += written;
+            stashed -= written;
+        }
+        int ready = !stashed && !_setformat_requested && __atomic_load_n(&state, __ATOMIC_ACQUIRE) == DDB_PLAYBACK_STATE_PLAYING;
+        uint32_t stride = _stride;
+        uint32_t target = data.ring_target;
+        deadbeef->mutex_unlock(mutex);
 
-    pw_properties_setf(props, PW_KEY_NODE_RATE, "1/%u", plugin.fmt.samplerate);
-    pw_stream_update_properties(data.stream, &props->dict);
-    pw_properties_free(props);
+        uint32_t fill = ring_fill(&data.ring, &data.ring.readindex);
+        uint32_t want = target > fill ? target - fill : 0;
+        want = SPA_MIN(want, sizeof(data.feeder_chunk));
+        if (stride) {
+            want -= want % stride;
+        }
 
-    if (0 != pw_stream_connect(data.stream,
-                PW_DIRECTION_OUTPUT,
-                PW_ID_ANY,
-                PW_STREAM_FLAG_AUTOCONNECT |
-                PW_STREAM_FLAG_MAP_BUFFERS |
-                PW_STREAM_FLAG_RT_PROCESS,
-                params, 1)) {
-        log_err("PipeWire: Error connecting stream!\n");
-        if (pw_properties_get(pw_stream_get_properties(data.stream), PW_KEY_REMOTE_NAME)) {
-            log_err("PipeWire: Please check if remote daemon name is valid and daemon is up.\n")
+        if (!ready || want == 0 || !deadbeef->streamer_ok_to_read(-1)) {
+            feeder_wait(DDBPW_FEEDER_WAIT_MS);
+            continue;
         }
-        return OP_ERROR_INTERNAL;
-    };
 
+        uint32_t seek_gen = __atomic_load_n(&data.seek_gen, __ATOMIC_ACQUIRE);
+        int bytesread = deadbeef->streamer_read(data.feeder_chunk, want);
+        trace_event(DDBPW_TRACE_FEEDER, DDBPW_EV_FEEDER_READ, SPA_MAX(bytesread, 0), fill, 0);
+        if (bytesread <= 0) {
+            feeder_wait(DDBPW_FEEDER_WAIT_MS);
+            continue;
+        }
 
-    state = DDB_PLAYBACK_STATE_PLAYING;
+        deadbeef->mutex_lock(mutex);
+        if (_setformat_requested) {
+            /* DeaDBeeF calls setformat from inside streamer_read, ahead of the
+             * first bytes in the new format. The ring still plays out the old
+             * one, so these wait until the switch is applied. */
+            stashed = bytesread;
+            stash_pos = 0;
+            stash_gen = seek_gen;
+        } else {
+            /* Tagged with the generation the read started under. One that
+             * straddles a seek request is still the old position and goes
+             * with the flush in ddbpw_seeked. */
+            feeder_write(data.feeder_chunk, bytesread, seek_gen);
+        }
+        deadbeef->mutex_unlock(mutex);
+    }
+}
 
-    return OP_ERROR_SUCCESS;
+static void feeder_start(void) {
+    if (data.feeder_tid) {
+        return;
+    }
+    data.feeder_quit = 0;
+    data.feeder_tid = deadbeef->thread_start(feeder_thread, NULL);
 }
 
-static void update_has_volume(void) {
-    plugin.has_volume = deadbeef->conf_get_int(CONFSTR_DDBPW_VOLUMECONTROL, DDBPW_DEFAULT_VOLUMECONTROL);
+static void feeder_stop(void) {
+    if (!data.feeder_tid) {
+        return;
+    }
+    __atomic_store_n(&data.feeder_quit, 1, __ATOMIC_RELEASE);
+    sem_post(&data.feeder_sem);
+    deadbeef->thread_join(data.feeder_tid);
+    data.feeder_tid = 0;
 }
 
 static int ddbpw_play(void) {
     trace ("ddbpw_play\n");
 
+    int64_t now = get_monotonic_ns();
+
+    deadbeef->mutex_lock(ctl_mutex);
+    // Already running, a play from another thread only resumes a pause
+    if (data.loop && !data.parked && state != DDB_PLAYBACK_STATE_STOPPED) {
+        if (state == DDB_PLAYBACK_STATE_PAUSED) {
+            ddbpw_unpause();
+        }
+        deadbeef->mutex_unlock(ctl_mutex);
+        return OP_ERROR_SUCCESS;
+    }
+    if (data.parked) {
+        char sig[sizeof(data.conf_sig)];
+        conf_signature(sig, sizeof(sig));
+        if (data.core_error || strcmp(sig, data.conf_sig)) {
+            ddbpw_free();
+        }
+    }
+    // A parked connection keeps its loop running, lock it before the mutex like everybody else
+    int parked = data.parked;
+    if (parked) {
+        pw_thread_loop_lock(data.loop);
+        data.parked = 0;
+    }
+
     deadbeef->mutex_lock(mutex);
 
     update_has_volume();
     _initialvol = plugin.has_volume ? deadbeef->volume_get_amp() : 1.0f;
 
-    if (!data.loop) {
-        ddbpw_init();
+    if (!data.loop && ddbpw_init() != OP_ERROR_SUCCESS) {
+        ddbpw_free();
+        deadbeef->mutex_unlock(mutex);
+        deadbeef->mutex_unlock(ctl_mutex);
+        return OP_ERROR_INTERNAL;
+    }
+    data.play_warm = parked;
+    trace_event(DDBPW_TRACE_CALLER, DDBPW_EV_PLAY, parked, 0, 0);
+    data.play_first_sample = 0;
+    __atomic_store_n(&data.play_requested, now, __ATOMIC_RELEASE);
+    data.preroll_ms = SPA_MAX(0, deadbeef->conf_get_int(CONFSTR_DDBPW_PREROLL, DDBPW_DEFAULT_PREROLL));
+    data.prerolling = data.preroll_ms > 0;
+    data.meter_props = deadbeef->conf_get_int(CONFSTR_DDBPW_METERPROPS, DDBPW_DEFAULT_METERPROPS);
+    data.seek_ms = SPA_MAX(0, deadbeef->conf_get_int(CONFSTR_DDBPW_SEEKLATENCY, DDBPW_DEFAULT_SEEKLATENCY));
+    data.seek_requested = 0;
+    data.seek_flushed = 0;
+    data.seek_gen_flushed = data.seek_mark_gen = data.seek_gen;
+
+    // The first play pays for the registry round trip, later ones find it connected
+    if (_nativeformat) {
+        sink_cache_ensure(&sink_cache);
     }
-
 
     int ret = ddbpw_set_spec(&plugin.fmt);
-    pw_thread_loop_start(data.loop);
+    data.preroll_bytes = SPA_MIN((uint32_t)((uint64_t)data.preroll_ms * plugin.fmt.samplerate / 1000 * _stride), data.ring_target);
+    stats_start();
+    latency_start();
+    powersave_start();
+    if (parked) {
+        pw_thread_loop_unlock(data.loop);
+    } else {
+        pw_thread_loop_start(data.loop);
+    }
     if (ret != 0) {
         ddbpw_free();
+    } else {
+        feeder_start();
     }
     deadbeef->mutex_unlock(mutex);
+    deadbeef->mutex_unlock(ctl_mutex);
     return ret;
 }
 
+/* Disconnects the streams but keeps the loop, core connection and ring
+ * for the next play. ddbpw_free still tears everything down. */
+static void ddbpw_park(void) {
+    struct timespec off = { 0, 0 };
+
+    __atomic_store_n(&state, DDB_PLAYBACK_STATE_STOPPED, __ATOMIC_RELEASE);
+    feeder_stop();
+
+    pw_thread_loop_lock(data.loop);
+    deadbeef->mutex_lock(mutex);
+    pw_loop_update_timer(pw_thread_loop_get_loop(data.loop), data.stats_timer, &off, &off, false);
+    pw_loop_update_timer(pw_thread_loop_get_loop(data.loop), data.format_timer, &off, &off, false);
+    pw_loop_update_timer(pw_thread_loop_get_loop(data.loop), data.latency_timer, &off, &off, false);
+    pw_loop_update_timer(pw_thread_loop_get_loop(data.loop), data.powersave_timer, &off, &off, false);
+    pw_loop_update_timer(pw_thread_loop_get_loop(data.loop), data.seek_timer, &off, &off, false);
+    __atomic_store_n(&_setformat_requested, 0, __ATOMIC_RELEASE);
+    // A deferred switch is dropped with its timer, the next play sets the format from scratch
+    __atomic_store_n(&data.format_switching, 0, __ATOMIC_RELEASE);
+    data.format_flush = 0;
+
+    if (data.seek_active) {
+        data.seek_active = 0;
+        data.latency_ms = data.seek_restore_ms;
+    }
+    // The next play connects with the normal quantum
+    if (data.powersave_active) {
+        powersave_account(&data, 1);
+        data.powersave_active = 0;
+        data.latency_ms = data.powersave_restore_ms;
+    }
+
+    for (int i = 0; i < data.n_mirrors; i++) {
+        pw_stream_disconnect(data.mirrors[i].stream);
+        data.mirrors[i].readindex = 0;
+        data.mirrors[i].flush = 0;
+    }
+    pw_stream_disconnect(data.stream);
+
+    // Nothing reads the ring now, start the next track from an empty one
+    data.ring.readindex = 0;
+    data.ring.writeindex = 0;
+    data.ring_flush = 0;
+    data.paused = 0;
+    data.prerolling = 0;
+    data.play_requested = 0;
+    data.unpause_requested = 0;
+    memset(&data.out_latency, 0, sizeof(data.out_latency));
+    data.out_latency_reported = 0;
+    data.parked = 1;
+    deadbeef->mutex_unlock(mutex);
+    pw_thread_loop_unlock(data.loop);
+}
+
 static int ddbpw_stop(void) {
+    int64_t start = get_monotonic_ns();
+
+    deadbeef->mutex_lock(ctl_mutex);
+    if (data.loop && !data.core_error && deadbeef->conf_get_int(CONFSTR_DDBPW_KEEPCONNECTED, DDBPW_DEFAULT_KEEPCONNECTED)) {
+        trace_event(DDBPW_TRACE_CALLER, DDBPW_EV_STOP, 1, 0, 0);
+        ddbpw_park();
+        deadbeef->mutex_unlock(ctl_mutex);
+        transition_record(DDBPW_TRANSITION_STOP, get_monotonic_ns() - start);
+        return OP_ERROR_SUCCESS;
+    }
+    trace_event(DDBPW_TRACE_CALLER, DDBPW_EV_STOP, 0, 0, 0);
     ddbpw_free();
+    deadbeef->mutex_unlock(ctl_mutex);
+    transition_record(DDBPW_TRANSITION_STOP, get_monotonic_ns() - start);
 
     return OP_ERROR_SUCCESS;
 }
 
 static int ddbpw_pause(void) {
-    if (!data.loop && ddbpw_play() != OP_ERROR_SUCCESS) {
+    deadbeef->mutex_lock(ctl_mutex);
+    if ((!data.loop || data.parked) && ddbpw_play() != OP_ERROR_SUCCESS) {
+        deadbeef->mutex_unlock(ctl_mutex);
         return OP_ERROR_INTERNAL;
     }
 
     // set pause state
-    state = DDB_PLAYBACK_STATE_PAUSED;
+    __atomic_store_n(&state, DDB_PLAYBACK_STATE_PAUSED, __ATOMIC_RELEASE);
+    int warm = deadbeef->conf_get_int(CONFSTR_DDBPW_WARMPAUSE, DDBPW_DEFAULT_WARMPAUSE);
+    // Published to the RT side by the release store of paused
+    __atomic_store_n(&data.pause_silent, 0, __ATOMIC_RELAXED);
+    trace_event(DDBPW_TRACE_CALLER, DDBPW_EV_PAUSE, warm, 0, 0);
+    powersave_wake("pause");
+    int64_t requested = get_monotonic_ns();
+    __atomic_store_n(&data.pause_requested, requested, __ATOMIC_RELAXED);
+
+    // Nothing will be heard until unpause, a seek in flight gives its short quantum back now
+    pw_thread_loop_lock(data.loop);
+    // The loop reports the unpause against it
+    data.warm_pause = warm;
+    seek_end(&data, "on pause");
+    pw_thread_loop_unlock(data.loop);
+
+    if (warm) {
+        // Park the stream on silence, whatever is buffered resumes from the exact sample
+        __atomic_store_n(&data.paused, 1, __ATOMIC_RELEASE);
+        deadbeef->mutex_unlock(ctl_mutex);
+        return OP_ERROR_SUCCESS;
+    }
+
     pw_thread_loop_lock(data.loop);
     pw_stream_flush(data.stream, 0);
     pw_stream_set_active(data.stream, 0);
+    for (int i = 0; i < data.n_mirrors; i++) {
+        pw_stream_flush(data.mirrors[i].stream, 0);
+        pw_stream_set_active(data.mirrors[i].stream, 0);
+    }
     pw_thread_loop_unlock(data.loop);
+    deadbeef->mutex_unlock(ctl_mutex);
+    transition_record(DDBPW_TRANSITION_PAUSE, get_monotonic_ns() - requested);
     return OP_ERROR_SUCCESS;
 }
 
 static int ddbpw_unpause(void) {
+    deadbeef->mutex_lock(ctl_mutex);
+    // A stop got in first, there is no stream left to resume
+    if (!data.loop || data.parked || state != DDB_PLAYBACK_STATE_PAUSED) {
+        deadbeef->mutex_unlock(ctl_mutex);
+        return OP_ERROR_SUCCESS;
+    }
+    trace_event(DDBPW_TRACE_CALLER, DDBPW_EV_UNPAUSE, 0, 0, 0);
     // unset pause state
-    if (state == DDB_PLAYBACK_STATE_PAUSED) {
-        state = DDB_PLAYBACK_STATE_PLAYING;
+    __atomic_store_n(&state, DDB_PLAYBACK_STATE_PLAYING, __ATOMIC_RELEASE);
+    __atomic_store_n(&data.first_sound, 0, __ATOMIC_RELAXED);
+    __atomic_store_n(&data.unpause_requested, get_monotonic_ns(), __ATOMIC_RELEASE);
+    if (__atomic_exchange_n(&data.paused, 0, __ATOMIC_RELEASE)) {
+        deadbeef->mutex_unlock(ctl_mutex);
+        return OP_ERROR_SUCCESS;
     }
+
     pw_thread_loop_lock(data.loop);
     pw_stream_set_active(data.stream, 1);
+    for (int i = 0; i < data.n_mirrors; i++) {
+        pw_stream_set_active(data.mirrors[i].stream, 1);
+    }
     pw_thread_loop_unlock(data.loop);
+    deadbeef->mutex_unlock(ctl_mutex);
     return OP_ERROR_SUCCESS;
 }
 
 
 static ddb_playback_state_t ddbpw_get_state(void) {
-    return state;
+    return __atomic_load_n(&state, __ATOMIC_ACQUIRE);
 }
 
 
 
 static int ddbpw_plugin_start(void) {
     mutex = deadbeef->mutex_create();
+    ctl_mutex = deadbeef->mutex_create();
+    trace_mutex = deadbeef->mutex_create();
+    sink_cache.mutex = deadbeef->mutex_create();
+    sink_cache.conn_mutex = deadbeef->mutex_create();
 
-    tfbytecode = deadbeef->tf_compile("[%artist% - ]%title%");
+    media_tfs_update();
     return 0;
 }
 
 static int ddbpw_plugin_stop(void) {
+    // A parked connection may still be around if nobody called free
+    ddbpw_free();
+    sink_cache_disconnect(&sink_cache);
+    free(sink_cache.sinks);
+    sink_cache.sinks = NULL;
+    sink_cache.max_sinks = 0;
+    deadbeef->mutex_free(sink_cache.mutex);
+    deadbeef->mutex_free(sink_cache.conn_mutex);
     deadbeef->mutex_free(mutex);
+    deadbeef->mutex_free(ctl_mutex);
+    __atomic_store_n(&trace_enabled, 0, __ATOMIC_RELEASE);
+    trace_flush();
+    if (trace_file) {
+        fclose(trace_file);
+        trace_file = NULL;
+    }
+    free(trace_rings);
+    trace_rings = NULL;
+    deadbeef->mutex_free(trace_mutex);
     deadbeef->tf_free(tfbytecode);
+    tfbytecode = NULL;
+    for (int i = 0; i < n_media_tfs; i++) {
+        deadbeef->tf_free(media_tfs[i].bytecode);
+    }
+    n_media_tfs = 0;
+    media_conf[0] = 0;
     return 0;
 }
 
@@ -677,38 +4020,224 @@ static int
 ddbpw_message (uint32_t id, uintptr_t ctx, uint32_t p1, uint32_t p2) {
     switch (id) {
     case DB_EV_SONGSTARTED:
+        deadbeef->mutex_lock(ctl_mutex);
         if (state == DDB_PLAYBACK_STATE_PLAYING) {
-            pw_thread_loop_lock(data.loop);
-            do_update_media_props(((ddb_event_track_t *)ctx)->track, NULL);
-            pw_thread_loop_unlock(data.loop);
+            update_media_props(((ddb_event_track_t *)ctx)->track);
+        }
+        powersave_wake("track change");
+        deadbeef->mutex_unlock(ctl_mutex);
+        break;
+    case DB_EV_SEEK:
+        deadbeef->mutex_lock(ctl_mutex);
+        // The streamer is about to move, reads from here on are the new position
+        if (data.stream && state != DDB_PLAYBACK_STATE_STOPPED) {
+            __atomic_fetch_add(&data.seek_gen, 1, __ATOMIC_RELEASE);
+        }
+        // Seek-to-sound counts from here
+        if (data.stream && state == DDB_PLAYBACK_STATE_PLAYING) {
+            __atomic_store_n(&data.seek_requested, get_monotonic_ns(), __ATOMIC_RELAXED);
+        }
+        deadbeef->mutex_unlock(ctl_mutex);
+        break;
+    case DB_EV_SEEKED:
+        ddbpw_seeked();
+        break;
+    case DDB_PW_MSG_GET_LATENCY: {
+        ddb_pw_latency_t *l = (ddb_pw_latency_t *)ctx;
+        if (!l || l->_size < sizeof(ddb_pw_latency_t) || ddbpw_get_state() == DDB_PLAYBACK_STATE_STOPPED) {
+            return -1;
+        }
+        latency_read(&data, l);
+        break;
+    }
+    case DDB_PW_MSG_TRACE_FLUSH:
+        return trace_flush();
+    case DDB_PW_MSG_GET_METER: {
+        ddb_pw_meter_t *m = (ddb_pw_meter_t *)ctx;
+        if (!m || m->_size < sizeof(ddb_pw_meter_t) || ddbpw_get_state() == DDB_PLAYBACK_STATE_STOPPED) {
+            return -1;
+        }
+        // Starts the meter, or keeps it running
+        int64_t now = get_monotonic_ns();
+        int64_t wanted = __atomic_exchange_n(&data.meter_wanted, now, __ATOMIC_RELAXED);
+        meter_read(&data, m);
+        if (now - wanted >= DDBPW_METER_IDLE_NS) {
+            m->frames = 0;
         }
         break;
+    }
     case DB_EV_VOLUMECHANGED:
+        deadbeef->mutex_lock(ctl_mutex);
         if (plugin.has_volume) {
-            set_volume(1, deadbeef->volume_get_amp());
+            queue_volume(deadbeef->volume_get_amp());
         }
+        powersave_wake("volume change");
+        deadbeef->mutex_unlock(ctl_mutex);
         break;
     case DB_EV_CONFIGCHANGED:
+        deadbeef->mutex_lock(ctl_mutex);
+        media_tfs_update();
         update_has_volume();
         if (plugin.has_volume) {
-            set_volume(1, deadbeef->volume_get_amp());
+            queue_volume(deadbeef->volume_get_amp());
         } else {
-            set_volume(1, 1.0f);
+            queue_volume(1.0f);
         }
+        deadbeef->mutex_unlock(ctl_mutex);
         break;
     }
     return 0;
 }
 
-struct enum_card_userdata {
-    void (*callback)(const char *name, const char *desc, void *);
-    void *userdata;
+static void sink_probe_free(struct sink_probe *p) {
+    if (!p) {
+        return;
+    }
+    spa_hook_remove(&p->listener);
+    pw_proxy_destroy(p->proxy);
+    free(p);
+}
+
+static uint32_t sink_format_bit(uint32_t format) {
+    switch (format) {
+    case SPA_AUDIO_FORMAT_S16_LE:
+        return DDBPW_SINK_S16;
+    case SPA_AUDIO_FORMAT_S24_LE:
+        return DDBPW_SINK_S24;
+    // DeaDBeeF has no 24 in 32 bit samples, S32 is the one conversion PipeWire then does
+    case SPA_AUDIO_FORMAT_S24_32_LE:
+    case SPA_AUDIO_FORMAT_S32_LE:
+        return DDBPW_SINK_S32;
+    case SPA_AUDIO_FORMAT_F32_LE:
+        return DDBPW_SINK_F32;
+    }
+    return 0;
+}
+
+// Registry loop thread. Every EnumFormat param widens what we know the sink takes.
+static void node_event_param(void *object, int seq, uint32_t id,
+        uint32_t index, uint32_t next, const struct spa_pod *param) {
+    struct sink_probe *p = object;
+    const struct spa_pod_object *obj = (const struct spa_pod_object *)param;
+    const struct spa_pod_prop *prop;
+    uint32_t media_type, media_subtype;
+
+    if (id != SPA_PARAM_EnumFormat || param == NULL ||
+            spa_format_parse(param, &media_type, &media_subtype) < 0 ||
+            media_type != SPA_MEDIA_TYPE_audio || media_subtype != SPA_MEDIA_SUBTYPE_raw) {
+        return;
+    }
+
+    deadbeef->mutex_lock(p->c->mutex);
+    SPA_POD_OBJECT_FOREACH(obj, prop) {
+        uint32_t n_vals, choice;
+        const struct spa_pod *val = spa_pod_get_values(&prop->value, &n_vals, &choice);
+        const uint32_t *ids = SPA_POD_BODY(val);
+        const int32_t *ints = SPA_POD_BODY(val);
+
+        switch (prop->key) {
+        case SPA_FORMAT_AUDIO_format:
+            if (val->type != SPA_TYPE_Id) {
+                break;
+            }
+            for (uint32_t i = 0; i < n_vals; i++) {
+                p->formats |= sink_format_bit(ids[i]);
+            }
+            break;
+        case SPA_FORMAT_AUDIO_rate:
+            if (val->type != SPA_TYPE_Int) {
+                break;
+            }
+            if (choice == SPA_CHOICE_Range && n_vals >= 3) {
+                p->rate_min = p->rate_min ? SPA_MIN(p->rate_min, (uint32_t)ints[1]) : (uint32_t)ints[1];
+                p->rate_max = SPA_MAX(p->rate_max, (uint32_t)ints[2]);
+                break;
+            }
+            for (uint32_t i = 0; i < n_vals && p->n_rates < DDBPW_SINK_MAX_RATES; i++) {
+                p->rates[p->n_rates++] = ints[i];
+            }
+            break;
+        }
+    }
+    p->valid = 1;
+    deadbeef->mutex_unlock(p->c->mutex);
+}
+
+static const struct pw_node_events node_events = {
+    PW_VERSION_NODE_EVENTS,
+    .param = node_event_param,
+};
+
+static struct sink_probe *sink_probe_new(struct sink_cache *c, uint32_t id) {
+    struct sink_probe *p = calloc(1, sizeof(struct sink_probe));
+
+    if (!p) {
+        return NULL;
+    }
+    p->c = c;
+    p->proxy = pw_registry_bind(c->registry, id, PW_TYPE_INTERFACE_Node, PW_VERSION_NODE, 0);
+    if (!p->proxy) {
+        free(p);
+        return NULL;
+    }
+    pw_node_add_listener((struct pw_node *)p->proxy, &p->listener, &node_events, p);
+    pw_node_enum_params((struct pw_node *)p->proxy, 0, SPA_PARAM_EnumFormat, 0, UINT32_MAX, NULL);
+    return p;
+}
+
+// The default sink comes as JSON, {"name":"alsa_output..."}
+static int metadata_property(void *object, uint32_t subject, const char *key, const char *type, const char *value) {
+    struct sink_cache *c = object;
+    const char *name;
+
+    if (subject != PW_ID_CORE || (key && strcmp(key, "default.audio.sink"))) {
+        return 0;
+    }
+
+    deadbeef->mutex_lock(c->mutex);
+    c->default_sink[0] = 0;
+    if (value && (name = strstr(value, "\"name\"")) && (name = strchr(name + 6, '"'))) {
+        const char *end = strchr(++name, '"');
+        if (end) {
+            snprintf(c->default_sink, sizeof(c->default_sink), "%.*s", (int)(end - name), name);
+        }
+    }
+    deadbeef->mutex_unlock(c->mutex);
+    return 0;
+}
+
+static const struct pw_metadata_events metadata_events = {
+    PW_VERSION_METADATA_EVENTS,
+    .property = metadata_property,
 };
 
+static void sink_cache_clear(struct sink_cache *c) {
+    deadbeef->mutex_lock(c->mutex);
+    for (int i = 0; i < c->n_sinks; i++) {
+        free(c->sinks[i].name);
+        free(c->sinks[i].desc);
+        sink_probe_free(c->sinks[i].probe);
+    }
+    c->n_sinks = 0;
+    deadbeef->mutex_unlock(c->mutex);
+}
+
 static void registry_event_global(void *data, uint32_t id,
         uint32_t permissions, const char *type, uint32_t version,
         const struct spa_dict *props) {
-    struct enum_card_userdata *enumuserdata = (struct enum_card_userdata *)data;
+    struct sink_cache *c = (struct sink_cache *)data;
+
+    if (!strcmp(type, PW_TYPE_INTERFACE_Metadata) && props && !c->metadata) {
+        const char *name = spa_dict_lookup(props, PW_KEY_METADATA_NAME);
+        if (name && !strcmp(name, "default")) {
+            c->metadata = pw_registry_bind(c->registry, id, PW_TYPE_INTERFACE_Metadata, PW_VERSION_METADATA, 0);
+            if (c->metadata) {
+                spa_zero(c->metadata_listener);
+                pw_metadata_add_listener(c->metadata, &c->metadata_listener, &metadata_events, c);
+            }
+        }
+        return;
+    }
 
     if (!strcmp(type, PW_TYPE_INTERFACE_Node) && props) {
         const char *media_class = spa_dict_lookup(props, PW_KEY_MEDIA_CLASS);
@@ -739,103 +4268,311 @@ static void registry_event_global(void *data, uint32_t id,
                 strcpy(buf, desc ? desc : "");
             }
 
-            enumuserdata->callback(name, buf, enumuserdata->userdata);
+            deadbeef->mutex_lock(c->mutex);
+            if (c->n_sinks == c->max_sinks) {
+                int max_sinks = c->max_sinks ? c->max_sinks * 2 : 16;
+                struct sink *sinks = realloc(c->sinks, max_sinks * sizeof(struct sink));
+                if (!sinks) {
+                    deadbeef->mutex_unlock(c->mutex);
+                    return;
+                }
+                c->sinks = sinks;
+                c->max_sinks = max_sinks;
+            }
+            c->sinks[c->n_sinks].id = id;
+            c->sinks[c->n_sinks].name = strdup(name);
+            c->sinks[c->n_sinks].desc = strdup(buf);
+            c->sinks[c->n_sinks].probe = sink_probe_new(c, id);
+            c->n_sinks++;
+            deadbeef->mutex_unlock(c->mutex);
+        }
+    }
+}
+
+static void registry_event_global_remove(void *data, uint32_t id) {
+    struct sink_cache *c = (struct sink_cache *)data;
+
+    deadbeef->mutex_lock(c->mutex);
+    for (int i = 0; i < c->n_sinks; i++) {
+        if (c->sinks[i].id == id) {
+            free(c->sinks[i].name);
+            free(c->sinks[i].desc);
+            sink_probe_free(c->sinks[i].probe);
+            memmove(&c->sinks[i], &c->sinks[i + 1], (c->n_sinks - i - 1) * sizeof(struct sink));
+            c->n_sinks--;
+            break;
         }
     }
+    deadbeef->mutex_unlock(c->mutex);
 }
 
 static const struct pw_registry_events registry_events = {
     PW_VERSION_REGISTRY_EVENTS,
     .global = registry_event_global,
+    .global_remove = registry_event_global_remove,
 };
 
-struct donedata {
-    int pending;
-    int done;
-    struct pw_main_loop *loop;
-};
-
-void core_event_done(void *object, uint32_t id, int seq) {
-    struct donedata *donedata = (struct donedata *)object;
-    if (id == PW_ID_CORE && seq == donedata->pending) {
-        donedata->done = 1;
-        pw_main_loop_quit(donedata->loop);
+static void core_event_done(void *object, uint32_t id, int seq) {
+    struct sink_cache *c = (struct sink_cache *)object;
+    if (id == PW_ID_CORE && seq == c->sync_seq) {
+        c->synced = 1;
+        pw_thread_loop_signal(c->loop, false);
     }
 }
 
-static int roundtrip(struct pw_core *core, struct pw_main_loop *loop) {
-    struct spa_hook core_listener;
-    struct donedata donedata = {0,0, loop};
-
-    const struct pw_core_events core_events = {
-        PW_VERSION_CORE_EVENTS,
-        .done = core_event_done,
-    };
-
-    spa_zero(core_listener);
-    pw_core_add_listener(core, &core_listener,
-            &core_events, &donedata);
+static void core_event_error(void *object, uint32_t id, int seq, int res, const char *message) {
+    struct sink_cache *c = (struct sink_cache *)object;
+    if (id == PW_ID_CORE && res == -EPIPE) {
+        // Daemon went away, everything we know is stale. Reconnect on next enumeration.
+        c->error = 1;
+        sink_cache_clear(c);
+        pw_thread_loop_signal(c->loop, false);
+    }
+}
 
-    donedata.pending = pw_core_sync(core, PW_ID_CORE, 0);
+static const struct pw_core_events core_events = {
+    PW_VERSION_CORE_EVENTS,
+    .done = core_event_done,
+    .error = core_event_error,
+};
 
-    while (!donedata.done) {
-        pw_main_loop_run(loop);
+static void sink_cache_disconnect(struct sink_cache *c) {
+    if (!c->loop) {
+        return;
     }
-    spa_hook_remove(&core_listener);
-    return 0;
-}
+    pw_thread_loop_stop(c->loop);
+
+    // Probes hold node proxies, those go before the core does
+    sink_cache_clear(c);
+    if (c->metadata) {
+        spa_hook_remove(&c->metadata_listener);
+        pw_proxy_destroy((struct pw_proxy *)c->metadata);
+        c->metadata = NULL;
+    }
+    c->default_sink[0] = 0;
+    if (c->registry) {
+        spa_hook_remove(&c->registry_listener);
+        pw_proxy_destroy((struct pw_proxy *)c->registry);
+        c->registry = NULL;
+    }
+    if (c->core) {
+        spa_hook_remove(&c->core_listener);
+        pw_core_disconnect(c->core);
+        c->core = NULL;
+    }
+    if (c->context) {
+        pw_context_destroy(c->context);
+        c->context = NULL;
+    }
+    pw_thread_loop_destroy(c->loop);
+    c->loop = NULL;
 
-static void
-ddbpw_enum_soundcards(void (*callback)(const char *name, const char *desc, void *), void *userdata) {
-    struct pw_main_loop *loop = NULL;
-    struct pw_context *context = NULL;
-    struct pw_core *core = NULL;
-    struct pw_registry *registry = NULL;
-    struct spa_hook registry_listener = {0};
-    struct enum_card_userdata enumuserdata = {0};
+    my_pw_deinit();
+}
 
+static int sink_cache_connect(struct sink_cache *c, const char *remote) {
     my_pw_init();
 
-    loop = pw_main_loop_new(NULL /* properties */);
-    context = pw_context_new(pw_main_loop_get_loop(loop),
+    c->synced = 0;
+    c->error = 0;
+    snprintf(c->remote, sizeof(c->remote), "%s", remote);
+
+    c->loop = pw_thread_loop_new("ddb_out_pw_registry", NULL);
+    c->context = pw_context_new(pw_thread_loop_get_loop(c->loop),
             NULL /* properties */,
             0 /* user_data size */);
-    if (!context) {
-        return;
+    if (!c->context) {
+        sink_cache_disconnect(c);
+        return -1;
     }
 
-    char remote[256] = { 0 };
-    deadbeef->conf_get_str(CONFSTR_DDBPW_REMOTENAME, DDBPW_DEFAULT_REMOTENAME, remote, sizeof(remote));
-
-    core = pw_context_connect(context,
+    c->core = pw_context_connect(c->context,
             pw_properties_new(
                 PW_KEY_REMOTE_NAME,  (remote[0] ? remote: NULL),
                 NULL),
             0 /* user_data size */);
-    if (!core) {
-        return;
+    if (!c->core) {
+        sink_cache_disconnect(c);
+        return -1;
     }
+    spa_zero(c->core_listener);
+    pw_core_add_listener(c->core, &c->core_listener, &core_events, c);
 
-    registry = pw_core_get_registry(core, PW_VERSION_REGISTRY,
+    c->registry = pw_core_get_registry(c->core, PW_VERSION_REGISTRY,
             0 /* user_data size */);
-    if (!registry) {
+    if (!c->registry) {
+        sink_cache_disconnect(c);
+        return -1;
+    }
+    spa_zero(c->registry_listener);
+    pw_registry_add_listener(c->registry, &c->registry_listener,
+            &registry_events, c);
+
+    c->sync_seq = pw_core_sync(c->core, PW_ID_CORE, 0);
+    pw_thread_loop_start(c->loop);
+
+    // Only the very first enumeration waits for the initial set of globals,
+    // then once more for the EnumFormat replies of the sinks found in it
+    pw_thread_loop_lock(c->loop);
+    for (int round = 0; round < 2; round++) {
+        while (!c->synced && !c->error) {
+            if (pw_thread_loop_timed_wait(c->loop, 2) != 0) {
+                break;
+            }
+        }
+        if (!c->synced || round) {
+            break;
+        }
+        c->synced = 0;
+        c->sync_seq = pw_core_sync(c->core, PW_ID_CORE, c->sync_seq);
+    }
+    pw_thread_loop_unlock(c->loop);
+    return 0;
+}
+
+// Connects on first use and again after the daemon or the remote name changed
+static int sink_cache_ensure(struct sink_cache *c) {
+    char remote[256] = { 0 };
+    int res = 0;
+
+    deadbeef->conf_get_str(CONFSTR_DDBPW_REMOTENAME, DDBPW_DEFAULT_REMOTENAME, remote, sizeof(remote));
+
+    deadbeef->mutex_lock(c->conn_mutex);
+    if (c->loop && (c->error || strcmp(c->remote, remote))) {
+        sink_cache_disconnect(c);
+    }
+    if (!c->loop) {
+        res = sink_cache_connect(c, remote);
+    }
+    deadbeef->mutex_unlock(c->conn_mutex);
+    return res;
+}
+
+static int sink_rate_supported(const struct sink_probe *p, uint32_t rate) {
+    if (p->rate_max && rate >= p->rate_min && rate <= p->rate_max) {
+        return 1;
+    }
+    for (int i = 0; i < p->n_rates; i++) {
+        if (p->rates[i] == rate) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+static uint32_t sink_closest_rate(const struct sink_probe *p, uint32_t rate) {
+    uint32_t best = 0;
+
+    if (p->rate_max) {
+        best = SPA_CLAMP(rate, p->rate_min, p->rate_max);
+    }
+    for (int i = 0; i < p->n_rates; i++) {
+        uint32_t r = p->rates[i];
+        uint32_t d = r > rate ? r - rate : rate - r;
+        uint32_t bd = best > rate ? best - rate : rate - best;
+        // On a tie go up, never lose bandwidth
+        if (!best || d < bd || (d == bd && r > best)) {
+            best = r;
+        }
+    }
+    return best ? best : rate;
+}
+
+/* Moves fmt to the closest format the configured sink takes natively, so
+ * DeaDBeeF converts once and the graph has nothing left to convert.
+ * Channels are left alone, PipeWire's channel mixer does a real downmix. */
+static void sink_native_format(ddb_waveformat_t *fmt) {
+    static const struct {
+        uint32_t bit;
+        int bps;
+        int is_float;
+    } order[] = {
+        { DDBPW_SINK_S16, 16, 0 },
+        { DDBPW_SINK_S24, 24, 0 },
+        { DDBPW_SINK_S32, 32, 0 },
+        { DDBPW_SINK_F32, 32, 1 },
+    };
+    struct sink_cache *c = &sink_cache;
+    char dev[256] = {0};
+    struct sink_probe *p = NULL;
+
+    deadbeef->conf_get_str (PW_PLUGIN_ID "_soundcard", "default", dev, sizeof(dev));
+
+    deadbeef->mutex_lock(c->mutex);
+    const char *name = strcmp(dev, "default") ? dev : c->default_sink;
+    for (int i = 0; i < c->n_sinks; i++) {
+        if (!strcmp(c->sinks[i].name, name) && c->sinks[i].probe && c->sinks[i].probe->valid) {
+            p = c->sinks[i].probe;
+            break;
+        }
+    }
+    if (!p) {
+        deadbeef->mutex_unlock(c->mutex);
+        trace("PipeWire: no format information for sink %s\n", name);
         return;
     }
 
-    enumuserdata.callback = callback;
-    enumuserdata.userdata = userdata;
+    if (p->n_rates || p->rate_max) {
+        if (!sink_rate_supported(p, fmt->samplerate)) {
+            fmt->samplerate = sink_closest_rate(p, fmt->samplerate);
+        }
+    }
+
+    int current = -1;
+    for (int i = 0; i < (int)SPA_N_ELEMENTS(order); i++) {
+        if (order[i].bps == fmt->bps && order[i].is_float == fmt->is_float) {
+            current = i;
+        }
+    }
+    if (p->formats && (current < 0 || !(p->formats & order[current].bit))) {
+        int pick = -1;
+        // The smallest native format that holds every bit we have, else the widest there is
+        for (int i = 0; i < (int)SPA_N_ELEMENTS(order); i++) {
+            if ((p->formats & order[i].bit) && order[i].bps >= fmt->bps && (!fmt->is_float || order[i].is_float)) {
+                pick = i;
+                break;
+            }
+        }
+        for (int i = SPA_N_ELEMENTS(order) - 1; pick < 0 && i >= 0; i--) {
+            if (p->formats & order[i].bit) {
+                pick = i;
+            }
+        }
+        if (pick >= 0) {
+            fmt->bps = order[pick].bps;
+            fmt->is_float = order[pick].is_float;
+        }
+    }
+    deadbeef->mutex_unlock(c->mutex);
+}
+
+static void
+ddbpw_enum_soundcards(void (*callback)(const char *name, const char *desc, void *), void *userdata) {
+    struct sink_cache *c = &sink_cache;
 
-    spa_zero(registry_listener);
-    pw_registry_add_listener(registry, &registry_listener,
-            &registry_events, &enumuserdata);
+    if (sink_cache_ensure(c) < 0) {
+        return;
+    }
 
-    roundtrip(core, loop);
+    // Hand out a copy so the callback runs without holding the cache lock
+    deadbeef->mutex_lock(c->mutex);
+    int n_sinks = c->n_sinks;
+    struct sink *sinks = n_sinks ? malloc(n_sinks * sizeof(struct sink)) : NULL;
+    if (!sinks) {
+        n_sinks = 0;
+    }
+    for (int i = 0; i < n_sinks; i++) {
+        sinks[i].name = strdup(c->sinks[i].name);
+        sinks[i].desc = strdup(c->sinks[i].desc);
+    }
+    deadbeef->mutex_unlock(c->mutex);
 
-    pw_proxy_destroy((struct pw_proxy *)registry);
-    pw_core_disconnect(core);
-    pw_context_destroy(context);
-    pw_main_loop_destroy(loop);
-    my_pw_deinit();
+    for (int i = 0; i < n_sinks; i++) {
+        callback(sinks[i].name, sinks[i].desc, userdata);
+        free(sinks[i].name);
+        free(sinks[i].desc);
+    }
+    free(sinks);
 }
 
 #define STR_HELPER(x) #x
@@ -845,6 +4582,35 @@ static const char settings_dlg[] =
 "property \"PipeWire remote daemon name (empty for default)\" entry " CONFSTR_DDBPW_REMOTENAME " " STR(DDBPW_DEFAULT_REMOTENAME) ";\n"
 "property \"Custom properties (overrides existing ones):\" label l;\n"
 "property \"\" entry " CONFSTR_DDBPW_PROPS " \"\" ;\n"
+"property \"Media name (title formatting)\" entry " CONFSTR_DDBPW_MEDIANAME " " STR(DDBPW_DEFAULT_MEDIANAME) ";\n"
+"property \"Extra media properties (key=title formatting, separated by ;):\" label l;\n"
+"property \"\" entry " CONFSTR_DDBPW_MEDIAPROPS " \"\" ;\n"
+"property \"Also play on these sinks (node names, comma separated, name@ms for own latency, name%50 for own volume):\" label l;\n"
+"property \"\" entry " CONFSTR_DDBPW_MIRRORS " \"\" ;\n"
+"property \"Ring buffer length (ms)\" entry " CONFSTR_DDBPW_RINGLENGTH " " STR(DDBPW_DEFAULT_RINGLENGTH) ";\n"
+"property \"Feeder thread scheduling\" select[3] " CONFSTR_DDBPW_FEEDER_POLICY " " STR(DDBPW_DEFAULT_FEEDER_POLICY) " Normal SCHED_FIFO SCHED_RR;\n"
+"property \"Feeder thread real-time priority (1-99)\" entry " CONFSTR_DDBPW_FEEDER_PRIORITY " " STR(DDBPW_DEFAULT_FEEDER_PRIORITY) ";\n"
+"property \"Feeder thread nice level (used when real-time is off or refused, 0 leaves it)\" entry " CONFSTR_DDBPW_FEEDER_NICE " " STR(DDBPW_DEFAULT_FEEDER_NICE) ";\n"
+"property \"Pin feeder thread to CPUs (e.g. 2,3 or 4-7, empty for any)\" entry " CONFSTR_DDBPW_FEEDER_CPUS " " STR(DDBPW_DEFAULT_FEEDER_CPUS) ";\n"
+"property \"Ask DeaDBeeF for the sink's native format\" checkbox " CONFSTR_DDBPW_NATIVEFORMAT " " STR(DDBPW_DEFAULT_NATIVEFORMAT) ";\n"
+"property \"Preroll before starting the stream (ms, 0 disables)\" entry " CONFSTR_DDBPW_PREROLL " " STR(DDBPW_DEFAULT_PREROLL) ";\n"
+"property \"Stay connected to PipeWire while stopped (faster start)\" checkbox " CONFSTR_DDBPW_KEEPCONNECTED " " STR(DDBPW_DEFAULT_KEEPCONNECTED) ";\n"
+"property \"Keep the stream running while paused (instant resume)\" checkbox " CONFSTR_DDBPW_WARMPAUSE " " STR(DDBPW_DEFAULT_WARMPAUSE) ";\n"
+"property \"Bit-perfect output (lock graph rate, no volume or channel mixing)\" checkbox " CONFSTR_DDBPW_BITPERFECT " " STR(DDBPW_DEFAULT_BITPERFECT) ";\n"
+"property \"Convert samples to\" select[4] " CONFSTR_DDBPW_CONVERT " " STR(DDBPW_DEFAULT_CONVERT) " \"Off (let PipeWire convert)\" F32 S24_32 \"F32 planar\";\n"
+"property \"Publish output levels as stream properties\" checkbox " CONFSTR_DDBPW_METERPROPS " " STR(DDBPW_DEFAULT_METERPROPS) ";\n"
+"property \"Record a binary trace (decode with ddbpw-trace)\" checkbox " CONFSTR_DDBPW_TRACE " " STR(DDBPW_DEFAULT_TRACE) ";\n"
+"property \"Trace file\" entry " CONFSTR_DDBPW_TRACEFILE " " STR(DDBPW_DEFAULT_TRACEFILE) ";\n"
+"property \"Statistics log interval (s, 0 disables)\" entry " CONFSTR_DDBPW_STATSINTERVAL " " STR(DDBPW_DEFAULT_STATSINTERVAL) ";\n"
+"property \"Adaptive latency (grow on underruns)\" checkbox " CONFSTR_DDBPW_ADAPTIVE " " STR(DDBPW_DEFAULT_ADAPTIVE) ";\n"
+"property \"Adaptive latency minimum (ms)\" entry " CONFSTR_DDBPW_ADAPTIVE_MIN " " STR(DDBPW_DEFAULT_ADAPTIVE_MIN) ";\n"
+"property \"Adaptive latency maximum (ms)\" entry " CONFSTR_DDBPW_ADAPTIVE_MAX " " STR(DDBPW_DEFAULT_ADAPTIVE_MAX) ";\n"
+"property \"Power saving: long quantum during steady playback\" checkbox " CONFSTR_DDBPW_POWERSAVE " " STR(DDBPW_DEFAULT_POWERSAVE) ";\n"
+"property \"Power saving latency (ms)\" entry " CONFSTR_DDBPW_POWERSAVE_LATENCY " " STR(DDBPW_DEFAULT_POWERSAVE_LATENCY) ";\n"
+"property \"Power saving after (s of steady playback)\" entry " CONFSTR_DDBPW_POWERSAVE_DELAY " " STR(DDBPW_DEFAULT_POWERSAVE_DELAY) ";\n"
+"property \"Latency right after a seek (ms, 0 keeps the normal one)\" entry " CONFSTR_DDBPW_SEEKLATENCY " " STR(DDBPW_DEFAULT_SEEKLATENCY) ";\n"
+"property \"Number of buffers (0 for PipeWire default)\" entry " CONFSTR_DDBPW_NBUFFERS " " STR(DDBPW_DEFAULT_NBUFFERS) ";\n"
+"property \"Size of each buffer (ms, 0 for one quantum)\" entry " CONFSTR_DDBPW_BUFFERSIZE " " STR(DDBPW_DEFAULT_BUFFERSIZE) ";\n"
 "property \"Use PipeWire volume control\" checkbox " CONFSTR_DDBPW_VOLUMECONTROL " " STR(DDBPW_DEFAULT_VOLUMECONTROL) ";\n"
 #ifdef ENABLE_BUFFER_OPTION
 "property \"Buffer length (ms)\" entry " CONFSTR_DDBPW_BUFLENGTH " " STR(DDBPW_DEFAULT_BUFLENGTH) ";\n"